@@ -0,0 +1,131 @@
+--
+-- Copyright (c) 2023 Red Hat, Inc.
+--
+-- Licensed under the Apache License, Version 2.0 (the "License");
+-- you may not use this file except in compliance with the License.
+-- You may obtain a copy of the License at
+--
+--     http://www.apache.org/licenses/LICENSE-2.0
+--
+-- Unless required by applicable law or agreed to in writing, software
+-- distributed under the License is distributed on an "AS IS" BASIS,
+-- WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+-- See the License for the specific language governing permissions and
+-- limitations under the License.
+--
+
+-- Microbenchmarks of the Lua/Java boundary.
+--
+-- Usage: lua bench.lua [iterations]
+--
+-- Expects Bench fixture compiled by build.sh into bench/classes.
+-- Prints one line per benchmark as tab-separated key=value pairs:
+-- name, number of calls, calls per second and p50/p99 call latency in
+-- microseconds, so results of different releases can be compared with
+-- standard text tools.
+
+local lujavrite = require "lujavrite"
+
+local iterations = tonumber(arg[1]) or 100000
+
+java_home = os.getenv("JAVA_HOME")
+if java_home == nil then
+   java_home = "/usr/lib/jvm/jre"
+end
+
+lujavrite.init(java_home .. "/lib/server/libjvm.so", "-Djava.class.path=bench/classes")
+
+local nano_time = lujavrite.method("java/lang/System", "nanoTime", "()J")
+
+local function report(name, calls, seconds, stats)
+   local line = string.format("name=%s\tcalls=%d\tcalls_per_sec=%.0f", name, calls, calls / seconds)
+   if stats ~= nil then
+      line = line .. string.format("\tp50_us=%.3f\tp99_us=%.3f", stats.p50 * 1e6, stats.p99 * 1e6)
+   end
+   print(line)
+end
+
+-- Run fn n times after warm-up, reporting throughput and latency
+-- percentiles of method identified by stats key.
+local function bench(name, key, n, fn)
+   for i = 1, n // 10 do
+      fn()
+   end
+   lujavrite.reset_stats()
+   lujavrite.enable_stats(true)
+   local start = nano_time()
+   for i = 1, n do
+      fn()
+   end
+   local seconds = (nano_time() - start) / 1e9
+   lujavrite.enable_stats(false)
+   report(name, n, seconds, lujavrite.stats()[key])
+end
+
+local S = "Ljava/lang/String;"
+
+local empty = lujavrite.method("Bench", "empty", "()V")
+bench("empty_handle", "Bench.empty()V", iterations, function()
+   empty()
+end)
+
+bench("empty_call", "Bench.empty()V", iterations, function()
+   lujavrite.call("Bench", "empty", "()V")
+end)
+
+bench("empty_uncached", "Bench.empty()V", iterations // 10, function()
+   lujavrite.flush_cache()
+   lujavrite.call("Bench", "empty", "()V")
+end)
+
+local strings1 = lujavrite.method("Bench", "strings1", "(" .. S .. ")I")
+bench("strings_1", "Bench.strings1(" .. S .. ")I", iterations, function()
+   strings1("abcdefgh")
+end)
+
+local strings4 = lujavrite.method("Bench", "strings4", "(" .. S:rep(4) .. ")I")
+bench("strings_4", "Bench.strings4(" .. S:rep(4) .. ")I", iterations, function()
+   strings4("abcdefgh", "abcdefgh", "abcdefgh", "abcdefgh")
+end)
+
+local strings8 = lujavrite.method("Bench", "strings8", "(" .. S:rep(8) .. ")I")
+bench("strings_8", "Bench.strings8(" .. S:rep(8) .. ")I", iterations, function()
+   strings8("abcdefgh", "abcdefgh", "abcdefgh", "abcdefgh", "abcdefgh", "abcdefgh", "abcdefgh", "abcdefgh")
+end)
+
+local echo = lujavrite.method("Bench", "echo", "(" .. S .. ")" .. S)
+local echo_bytes = lujavrite.method("Bench", "echoBytes", "([B)[B")
+local buffer_size = lujavrite.method("Bench", "bufferSize", "(Ljava/nio/ByteBuffer;)I")
+for _, size in ipairs({1024, 65536, 1048576}) do
+   local payload = ("x"):rep(size)
+   local n = math.max(iterations * 64 // size, 100)
+   bench("echo_string_" .. size, "Bench.echo(" .. S .. ")" .. S, n, function()
+      echo(payload)
+   end)
+   bench("echo_bytes_" .. size, "Bench.echoBytes([B)[B", n, function()
+      echo_bytes(payload)
+   end)
+   bench("byte_buffer_" .. size, "Bench.bufferSize(Ljava/nio/ByteBuffer;)I", n, function()
+      buffer_size(payload)
+   end)
+end
+
+-- Scaling of concurrent calls executed by async worker pool, with
+-- given number of calls in flight
+local work = lujavrite.method("Bench", "work", "(I)J")
+local n = math.max(iterations // 10, 100)
+for _, width in ipairs({1, 2, 4, 8}) do
+   local start = nano_time()
+   local futures = {}
+   for i = 1, n do
+      if #futures == width then
+         futures[1]:result()
+         table.remove(futures, 1)
+      end
+      futures[#futures + 1] = lujavrite.call_async(work, 10000)
+   end
+   for _, future in ipairs(futures) do
+      future:result()
+   end
+   report("async_work_x" .. width, n, (nano_time() - start) / 1e9)
+end
@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2023 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+import java.nio.ByteBuffer;
+
+/**
+ * Fixture methods called by bench.lua.  They do as little work as
+ * possible, so that measurements are dominated by call overhead.
+ */
+public final class Bench {
+    private static volatile long sink;
+
+    public static void empty() {
+    }
+
+    public static int strings1(String a) {
+        return a.length();
+    }
+
+    public static int strings4(String a, String b, String c, String d) {
+        return a.length() + b.length() + c.length() + d.length();
+    }
+
+    public static int strings8(String a, String b, String c, String d, String e, String f, String g,
+            String h) {
+        return a.length() + b.length() + c.length() + d.length() + e.length() + f.length() + g.length()
+                + h.length();
+    }
+
+    public static String echo(String s) {
+        return s;
+    }
+
+    public static byte[] echoBytes(byte[] b) {
+        return b;
+    }
+
+    public static int bufferSize(ByteBuffer b) {
+        return b.remaining();
+    }
+
+    /** Busy loop used to measure scaling of concurrent calls. */
+    public static long work(int n) {
+        long x = n;
+        for (int i = 0; i < n; i++) {
+            x = x * 6364136223846793005L + 1442695040888963407L;
+        }
+        sink = x;
+        return x;
+    }
+}
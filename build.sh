@@ -23,9 +23,25 @@ LDFLAGS=${LDFLAGS:-}
 ${CC} \
     -shared \
     -fPIC \
+    -pthread \
     -I${JAVA_HOME}/include \
     -I${JAVA_HOME}/include/linux \
     ${CFLAGS} \
     ${LDFLAGS} \
     -o lujavrite.so \
     lujavrite.c
+
+mkdir -p classes
+${JAVA_HOME}/bin/javac \
+    -d classes \
+    java/io/kojan/lujavrite/*.java
+${JAVA_HOME}/bin/jar \
+    --create \
+    --file lujavrite.jar \
+    -C classes \
+    .
+
+mkdir -p bench/classes
+${JAVA_HOME}/bin/javac \
+    -d bench/classes \
+    bench/Bench.java
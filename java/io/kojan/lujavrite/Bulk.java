@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2023 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package io.kojan.lujavrite;
+
+import java.io.ByteArrayOutputStream;
+import java.io.DataOutputStream;
+import java.io.IOException;
+import java.io.UncheckedIOException;
+import java.lang.reflect.Array;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.Collection;
+import java.util.Iterator;
+import java.util.LinkedHashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.stream.BaseStream;
+
+/**
+ * Bulk conversion between Lua tables and Java collections.
+ *
+ * <p>LuJavRite packs whole Lua table into one buffer of tagged values,
+ * which is turned into Java collection by single call of one of the
+ * methods of this class, and the other way round.  Values are tagged
+ * with {@code 'N'} (null), {@code 'Z'} (boolean byte), {@code 'J'}
+ * (8-byte integer), {@code 'D'} (8-byte double), {@code 'S'} (4-byte
+ * length and UTF-8 bytes), {@code 'A'} (4-byte count and elements of
+ * list) or {@code 'M'} (4-byte count and keys and values of map), all
+ * big-endian.
+ */
+public final class Bulk {
+    private static final int MAX_DEPTH = 64;
+
+    private Bulk() {
+    }
+
+    public static Object decode(ByteBuffer buf) {
+        return read(buf.order(ByteOrder.BIG_ENDIAN), 0);
+    }
+
+    public static List<?> list(ByteBuffer buf) {
+        return (List<?>) read(buf.order(ByteOrder.BIG_ENDIAN), 0);
+    }
+
+    public static Map<?, ?> map(ByteBuffer buf) {
+        return (Map<?, ?>) read(buf.order(ByteOrder.BIG_ENDIAN), 0);
+    }
+
+    public static String[] strings(ByteBuffer buf) {
+        return toStrings(list(buf));
+    }
+
+    static String[] toStrings(List<?> list) {
+        String[] strings = new String[list.size()];
+        for (int i = 0; i < strings.length; i++) {
+            Object value = list.get(i);
+            strings[i] = value == null ? null : value.toString();
+        }
+        return strings;
+    }
+
+    static Object toArray(List<?> list, Class<?> componentType) {
+        Object array = Array.newInstance(componentType, list.size());
+        for (int i = 0; i < list.size(); i++) {
+            Number value = (Number) list.get(i);
+            if (componentType == short.class) {
+                Array.setShort(array, i, value.shortValue());
+            } else if (componentType == int.class) {
+                Array.setInt(array, i, value.intValue());
+            } else if (componentType == long.class) {
+                Array.setLong(array, i, value.longValue());
+            } else if (componentType == float.class) {
+                Array.setFloat(array, i, value.floatValue());
+            } else if (componentType == double.class) {
+                Array.setDouble(array, i, value.doubleValue());
+            } else {
+                throw new IllegalArgumentException("unsupported array type: " + componentType);
+            }
+        }
+        return array;
+    }
+
+    /**
+     * Get iterator over elements of Iterator, Iterable or Stream, which
+     * closes the stream once it is exhausted.
+     */
+    public static Iterator<?> iterator(Object source) {
+        if (source instanceof Iterator) {
+            return (Iterator<?>) source;
+        }
+        if (source instanceof Iterable) {
+            return ((Iterable<?>) source).iterator();
+        }
+        if (source instanceof BaseStream) {
+            BaseStream<?, ?> stream = (BaseStream<?, ?>) source;
+            Iterator<?> it = stream.iterator();
+            return new Iterator<Object>() {
+                @Override
+                public boolean hasNext() {
+                    boolean more = it.hasNext();
+                    if (!more) {
+                        stream.close();
+                    }
+                    return more;
+                }
+
+                @Override
+                public Object next() {
+                    return it.next();
+                }
+            };
+        }
+        throw new IllegalArgumentException("not iterable: " + source.getClass().getName());
+    }
+
+    /**
+     * Pack up to n next elements of iterator as list, or return null if
+     * there are no more elements.
+     */
+    public static byte[] next(Iterator<?> it, int n) {
+        if (!it.hasNext()) {
+            return null;
+        }
+        List<Object> chunk = new ArrayList<>(n);
+        while (chunk.size() < n && it.hasNext()) {
+            chunk.add(it.next());
+        }
+        return pack(chunk);
+    }
+
+    /**
+     * Pack collection, map, array or simple value into tagged values.
+     */
+    public static byte[] pack(Object value) {
+        ByteArrayOutputStream bytes = new ByteArrayOutputStream();
+        try {
+            DataOutputStream out = new DataOutputStream(bytes);
+            write(out, value, 0);
+            out.flush();
+        } catch (IOException e) {
+            throw new UncheckedIOException(e);
+        }
+        return bytes.toByteArray();
+    }
+
+    static Object read(ByteBuffer buf, int depth) {
+        int tag = buf.get();
+        switch (tag) {
+            case 'N':
+                return null;
+            case 'Z':
+                return buf.get() != 0;
+            case 'J':
+                return buf.getLong();
+            case 'D':
+                return buf.getDouble();
+            case 'S': {
+                byte[] bytes = new byte[buf.getInt()];
+                buf.get(bytes);
+                return new String(bytes, StandardCharsets.UTF_8);
+            }
+            case 'A': {
+                checkDepth(depth);
+                int n = buf.getInt();
+                List<Object> list = new ArrayList<>(Math.min(n, buf.remaining()));
+                for (int i = 0; i < n; i++) {
+                    list.add(read(buf, depth + 1));
+                }
+                return list;
+            }
+            case 'M': {
+                checkDepth(depth);
+                int n = buf.getInt();
+                Map<Object, Object> map = new LinkedHashMap<>();
+                for (int i = 0; i < n; i++) {
+                    Object key = read(buf, depth + 1);
+                    map.put(key, read(buf, depth + 1));
+                }
+                return map;
+            }
+            default:
+                throw new IllegalArgumentException("unknown value tag: " + tag);
+        }
+    }
+
+    static void write(DataOutputStream out, Object value, int depth) throws IOException {
+        if (value == null) {
+            out.writeByte('N');
+        } else if (value instanceof Boolean) {
+            out.writeByte('Z');
+            out.writeByte((Boolean) value ? 1 : 0);
+        } else if (value instanceof Float || value instanceof Double) {
+            out.writeByte('D');
+            out.writeDouble(((Number) value).doubleValue());
+        } else if (value instanceof Byte || value instanceof Short || value instanceof Integer
+                || value instanceof Long) {
+            out.writeByte('J');
+            out.writeLong(((Number) value).longValue());
+        } else if (value instanceof CharSequence || value instanceof Character) {
+            writeBytes(out, value.toString().getBytes(StandardCharsets.UTF_8));
+        } else if (value instanceof byte[]) {
+            writeBytes(out, (byte[]) value);
+        } else if (value instanceof Map) {
+            checkDepth(depth);
+            Map<?, ?> map = (Map<?, ?>) value;
+            out.writeByte('M');
+            out.writeInt(map.size());
+            for (Map.Entry<?, ?> entry : map.entrySet()) {
+                write(out, entry.getKey(), depth + 1);
+                write(out, entry.getValue(), depth + 1);
+            }
+        } else if (value instanceof Collection) {
+            checkDepth(depth);
+            Collection<?> collection = (Collection<?>) value;
+            out.writeByte('A');
+            out.writeInt(collection.size());
+            for (Object element : collection) {
+                write(out, element, depth + 1);
+            }
+        } else if (value.getClass().isArray()) {
+            checkDepth(depth);
+            int n = Array.getLength(value);
+            out.writeByte('A');
+            out.writeInt(n);
+            for (int i = 0; i < n; i++) {
+                write(out, Array.get(value, i), depth + 1);
+            }
+        } else {
+            throw new IllegalArgumentException("unsupported value: " + value.getClass().getName());
+        }
+    }
+
+    private static void writeBytes(DataOutputStream out, byte[] bytes) throws IOException {
+        out.writeByte('S');
+        out.writeInt(bytes.length);
+        out.write(bytes);
+    }
+
+    private static void checkDepth(int depth) {
+        if (depth == MAX_DEPTH) {
+            throw new IllegalArgumentException("nesting too deep");
+        }
+    }
+}
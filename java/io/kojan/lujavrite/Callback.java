@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2023 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package io.kojan.lujavrite;
+
+import java.util.function.UnaryOperator;
+
+/**
+ * Lua function callable from Java, created by {@code lujavrite.callback()}.
+ *
+ * <p>Callbacks run in the Lua state that created them, so they can only
+ * be called while that state is calling Java, from the same thread.
+ * Arguments are converted to Lua values like return values of Java
+ * methods, and the first value returned by the Lua function is
+ * converted back to {@code null}, {@code Boolean}, {@code Long},
+ * {@code Double}, {@code String}, the object of an object handle or,
+ * for tables, a {@code List} or {@code Map}.  Lua errors are thrown as
+ * {@link LuaException}, while Java exceptions raised by Java calls made
+ * from the callback are rethrown as they are.
+ */
+public final class Callback implements UnaryOperator<Object> {
+    private final long id;
+
+    private Callback(long id) {
+        this.id = id;
+    }
+
+    public Object call(Object... args) {
+        byte[] types = new byte[args.length];
+        for (int i = 0; i < args.length; i++) {
+            types[i] = typeOf(args[i]);
+        }
+        return invoke(id, args, types);
+    }
+
+    @Override
+    public Object apply(Object arg) {
+        return call(arg);
+    }
+
+    private static byte typeOf(Object value) {
+        if (value == null) {
+            return 'N';
+        }
+        if (value instanceof Boolean) {
+            return 'Z';
+        }
+        if (value instanceof Long || value instanceof Integer || value instanceof Short
+                || value instanceof Byte) {
+            return 'J';
+        }
+        if (value instanceof Double || value instanceof Float) {
+            return 'D';
+        }
+        if (value instanceof String) {
+            return 'T';
+        }
+        return 'L';
+    }
+
+    private static native Object invoke(long id, Object[] args, byte[] types);
+}
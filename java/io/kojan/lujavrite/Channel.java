@@ -0,0 +1,207 @@
+/*-
+ * Copyright (c) 2023 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package io.kojan.lujavrite;
+
+import java.lang.invoke.MethodHandles;
+import java.lang.invoke.VarHandle;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.concurrent.locks.LockSupport;
+
+/**
+ * Single-producer single-consumer ring buffer shared with Lua, created
+ * by {@code lujavrite.channel()}.
+ *
+ * <p>One side of the channel is the Lua state that created it and the
+ * other is a single Java thread; either can be the producer.  Records
+ * are byte arrays copied into a direct buffer, so neither side calls
+ * the other while the ring is neither empty nor full.  A side waiting
+ * for data or space announces it with a flag in the buffer and the
+ * other side wakes it up after its next change of the ring.
+ *
+ * <p>The buffer starts with control words, each on its own cache line:
+ * consumer position, producer position, Lua waiting flag followed by
+ * Lua wakeup counter, Java waiting flag and closed flag.  Positions
+ * grow monotonically and are taken modulo ring capacity, which is a
+ * power of two.  Each record is 4-byte native-endian length followed
+ * by payload padded to a multiple of 4 bytes, which may wrap around
+ * the end of the ring.
+ */
+public final class Channel {
+    static final int HEAD = 0;
+    static final int TAIL = 64;
+    static final int LUA_WAITING = 128;
+    static final int LUA_WAKE = 132;
+    static final int JAVA_WAITING = 192;
+    static final int CLOSED = 256;
+    static final int DATA = 320;
+
+    private static final VarHandle LONG =
+            MethodHandles.byteBufferViewVarHandle(long[].class, ByteOrder.nativeOrder());
+    private static final VarHandle INT =
+            MethodHandles.byteBufferViewVarHandle(int[].class, ByteOrder.nativeOrder());
+
+    private final ByteBuffer buf;
+    private final int capacity;
+    private volatile Thread waiter;
+
+    Channel(int capacity) {
+        this.buf = ByteBuffer.allocateDirect(DATA + capacity + 64).alignedSlice(64).order(ByteOrder.nativeOrder());
+        this.capacity = capacity;
+    }
+
+    ByteBuffer buffer() {
+        return buf;
+    }
+
+    /**
+     * Append record if there is space for it.
+     *
+     * @return {@code false} if the ring is full
+     * @throws IllegalStateException if the channel is closed
+     */
+    public boolean offer(byte[] record) {
+        int need = size(record.length);
+        if (need > capacity) {
+            throw new IllegalArgumentException("record too large for channel");
+        }
+        if (isClosed()) {
+            throw new IllegalStateException("channel is closed");
+        }
+        long tail = (long) LONG.getVolatile(buf, TAIL);
+        if (capacity - (tail - (long) LONG.getVolatile(buf, HEAD)) < need) {
+            return false;
+        }
+        int pos = (int) tail & (capacity - 1);
+        buf.putInt(DATA + pos, record.length);
+        pos = (pos + 4) & (capacity - 1);
+        int first = Math.min(record.length, capacity - pos);
+        buf.put(DATA + pos, record, 0, first);
+        buf.put(DATA, record, first, record.length - first);
+        LONG.setVolatile(buf, TAIL, tail + need);
+        wakeLua();
+        return true;
+    }
+
+    /**
+     * Append record, waiting for space if the ring is full.
+     *
+     * @throws IllegalStateException if the channel is closed
+     */
+    public void put(byte[] record) throws InterruptedException {
+        while (!offer(record)) {
+            await(() -> isClosed() || capacity - used() >= size(record.length));
+        }
+    }
+
+    /**
+     * Remove next record.
+     *
+     * @return the record, or {@code null} if the ring is empty
+     */
+    public byte[] poll() {
+        long head = (long) LONG.getVolatile(buf, HEAD);
+        if ((long) LONG.getVolatile(buf, TAIL) == head) {
+            return null;
+        }
+        int pos = (int) head & (capacity - 1);
+        byte[] record = new byte[buf.getInt(DATA + pos)];
+        pos = (pos + 4) & (capacity - 1);
+        int first = Math.min(record.length, capacity - pos);
+        buf.get(DATA + pos, record, 0, first);
+        buf.get(DATA, record, first, record.length - first);
+        LONG.setVolatile(buf, HEAD, head + size(record.length));
+        wakeLua();
+        return record;
+    }
+
+    /**
+     * Remove next record, waiting for one if the ring is empty.
+     *
+     * @return the record, or {@code null} if the channel is closed and
+     *     all records have been taken
+     */
+    public byte[] take() throws InterruptedException {
+        for (;;) {
+            byte[] record = poll();
+            if (record != null) {
+                return record;
+            }
+            if (isClosed()) {
+                return poll();
+            }
+            await(() -> isClosed() || used() > 0);
+        }
+    }
+
+    /**
+     * Close the channel.  Records already in the ring can still be
+     * taken, but no more can be added.
+     */
+    public void close() {
+        INT.setVolatile(buf, CLOSED, 1);
+        wakeLua();
+    }
+
+    public boolean isClosed() {
+        return (int) INT.getVolatile(buf, CLOSED) != 0;
+    }
+
+    private interface Condition {
+        boolean holds();
+    }
+
+    private static int size(int length) {
+        return 4 + ((length + 3) & ~3);
+    }
+
+    private long used() {
+        return (long) LONG.getVolatile(buf, TAIL) - (long) LONG.getVolatile(buf, HEAD);
+    }
+
+    private void await(Condition ready) throws InterruptedException {
+        waiter = Thread.currentThread();
+        INT.setVolatile(buf, JAVA_WAITING, 1);
+        try {
+            while (!ready.holds()) {
+                LockSupport.park(this);
+                if (Thread.interrupted()) {
+                    throw new InterruptedException();
+                }
+            }
+        } finally {
+            INT.setVolatile(buf, JAVA_WAITING, 0);
+            waiter = null;
+        }
+    }
+
+    /** Called from Lua side when it changed the ring while Java was waiting. */
+    private void wake() {
+        Thread thread = waiter;
+        if (thread != null) {
+            LockSupport.unpark(thread);
+        }
+    }
+
+    private void wakeLua() {
+        if ((int) INT.getVolatile(buf, LUA_WAITING) != 0) {
+            INT.getAndAdd(buf, LUA_WAKE, 1);
+            wakeNative(buf);
+        }
+    }
+
+    private static native void wakeNative(ByteBuffer buf);
+}
@@ -0,0 +1,291 @@
+/*-
+ * Copyright (c) 2023 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package io.kojan.lujavrite;
+
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
+import java.io.ByteArrayOutputStream;
+import java.io.DataInputStream;
+import java.io.DataOutputStream;
+import java.io.EOFException;
+import java.io.IOException;
+import java.io.PrintWriter;
+import java.io.StringWriter;
+import java.lang.reflect.InvocationTargetException;
+import java.lang.reflect.Method;
+import java.lang.reflect.Modifier;
+import java.net.StandardProtocolFamily;
+import java.net.UnixDomainSocketAddress;
+import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
+import java.nio.channels.ServerSocketChannel;
+import java.nio.channels.SocketChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.List;
+import java.util.concurrent.ConcurrentHashMap;
+import java.util.concurrent.ConcurrentMap;
+
+/**
+ * Long-lived JVM serving LuJavRite calls over Unix domain socket.
+ *
+ * <p>Lua processes run with {@code LUJAVRITE_SERVER} environment
+ * variable set to the socket path connect to it from
+ * {@code lujavrite.init()} and have their {@code call()} invocations
+ * executed by this JVM, which avoids JVM startup in every process and
+ * keeps JIT-compiled code warm.
+ *
+ * <p>Each request and reply is a frame consisting of 4-byte big-endian
+ * payload length followed by payload.  Request payload is opcode byte
+ * ({@code 1} for static call), class name, method name and method
+ * signature as strings, argument count byte and tagged argument values.
+ * Reply payload is status byte ({@code 0} for success, {@code 1} for
+ * exception) followed by tagged return value, or by exception class
+ * name, message and stack trace as tagged values.  Strings are encoded
+ * as 4-byte length followed by UTF-8 bytes.  Values are tagged with
+ * {@code 'V'} (void), {@code 'N'} (null), {@code 'Z'} (boolean byte),
+ * {@code 'J'} (8-byte integer), {@code 'D'} (8-byte double) or
+ * {@code 'S'} (string or raw bytes).  Lists, maps and String[] are
+ * encoded as described in {@link Bulk}.
+ */
+public final class Server {
+    private static final int OP_CALL = 1;
+    private static final int STATUS_OK = 0;
+    private static final int STATUS_EXCEPTION = 1;
+
+    private final ConcurrentMap<String, Method> methods = new ConcurrentHashMap<>();
+
+    public static void main(String[] args) throws IOException {
+        if (args.length != 1) {
+            System.err.println("Usage: java io.kojan.lujavrite.Server <socket-path>");
+            System.exit(1);
+        }
+        new Server().serve(Path.of(args[0]));
+    }
+
+    private void serve(Path path) throws IOException {
+        Files.deleteIfExists(path);
+        try (ServerSocketChannel server = ServerSocketChannel.open(StandardProtocolFamily.UNIX)) {
+            server.bind(UnixDomainSocketAddress.of(path));
+            for (;;) {
+                SocketChannel client = server.accept();
+                Thread thread = new Thread(() -> handle(client), "lujavrite-client");
+                thread.setDaemon(true);
+                thread.start();
+            }
+        }
+    }
+
+    private void handle(SocketChannel client) {
+        try (client;
+                DataInputStream in =
+                        new DataInputStream(new BufferedInputStream(Channels.newInputStream(client)));
+                DataOutputStream out =
+                        new DataOutputStream(new BufferedOutputStream(Channels.newOutputStream(client)))) {
+            for (;;) {
+                int len;
+                try {
+                    len = in.readInt();
+                } catch (EOFException e) {
+                    return;
+                }
+                byte[] frame = new byte[len];
+                in.readFully(frame);
+                byte[] reply = process(ByteBuffer.wrap(frame));
+                out.writeInt(reply.length);
+                out.write(reply);
+                out.flush();
+            }
+        } catch (IOException e) {
+            // Client went away
+        }
+    }
+
+    private byte[] process(ByteBuffer frame) throws IOException {
+        ByteArrayOutputStream bytes = new ByteArrayOutputStream();
+        DataOutputStream reply = new DataOutputStream(bytes);
+        try {
+            int op = frame.get();
+            if (op != OP_CALL) {
+                throw new IllegalArgumentException("unknown request: " + op);
+            }
+            String className = readString(frame);
+            String name = readString(frame);
+            String signature = readString(frame);
+            Method method = resolve(className, name, signature);
+            Class<?>[] types = method.getParameterTypes();
+            int n = frame.get() & 0xFF;
+            if (n != types.length) {
+                throw new IllegalArgumentException("expected " + types.length + " arguments, got " + n);
+            }
+            Object[] args = new Object[n];
+            for (int i = 0; i < n; i++) {
+                args[i] = readValue(frame, types[i]);
+            }
+            Object ret;
+            try {
+                ret = method.invoke(null, args);
+            } catch (InvocationTargetException e) {
+                throw e.getCause();
+            }
+            ByteArrayOutputStream value = new ByteArrayOutputStream();
+            writeValue(new DataOutputStream(value), ret, method.getReturnType());
+            reply.writeByte(STATUS_OK);
+            value.writeTo(reply);
+        } catch (Throwable e) {
+            bytes.reset();
+            StringWriter trace = new StringWriter();
+            e.printStackTrace(new PrintWriter(trace));
+            reply.writeByte(STATUS_EXCEPTION);
+            writeValue(reply, e.getClass().getName(), String.class);
+            writeValue(reply, e.getMessage(), String.class);
+            writeValue(reply, trace.toString(), String.class);
+        }
+        reply.flush();
+        return bytes.toByteArray();
+    }
+
+    private Method resolve(String className, String name, String signature) throws ClassNotFoundException,
+            NoSuchMethodException {
+        String key = className + '.' + name + signature;
+        Method method = methods.get(key);
+        if (method == null) {
+            Class<?> cls = Class.forName(className.replace('/', '.'), true, ClassLoader.getSystemClassLoader());
+            // Like GetStaticMethodID(), look for the method in superclasses too
+            for (Class<?> c = cls; c != null && method == null; c = c.getSuperclass()) {
+                for (Method m : c.getDeclaredMethods()) {
+                    if (Modifier.isStatic(m.getModifiers()) && m.getName().equals(name)
+                            && descriptor(m).equals(signature)) {
+                        m.setAccessible(true);
+                        method = m;
+                        break;
+                    }
+                }
+            }
+            if (method == null) {
+                throw new NoSuchMethodError(name);
+            }
+            methods.putIfAbsent(key, method);
+        }
+        return method;
+    }
+
+    private static String descriptor(Method m) {
+        StringBuilder sb = new StringBuilder("(");
+        for (Class<?> type : m.getParameterTypes()) {
+            sb.append(descriptor(type));
+        }
+        return sb.append(')').append(descriptor(m.getReturnType())).toString();
+    }
+
+    private static String descriptor(Class<?> type) {
+        if (type.isArray()) {
+            return type.getName().replace('.', '/');
+        }
+        if (type == void.class) return "V";
+        if (type == boolean.class) return "Z";
+        if (type == byte.class) return "B";
+        if (type == char.class) return "C";
+        if (type == short.class) return "S";
+        if (type == int.class) return "I";
+        if (type == long.class) return "J";
+        if (type == float.class) return "F";
+        if (type == double.class) return "D";
+        return "L" + type.getName().replace('.', '/') + ";";
+    }
+
+    private static String readString(ByteBuffer frame) {
+        byte[] bytes = new byte[frame.getInt()];
+        frame.get(bytes);
+        return new String(bytes, StandardCharsets.UTF_8);
+    }
+
+    private static Object readValue(ByteBuffer frame, Class<?> type) {
+        int tag = frame.get();
+        switch (tag) {
+            case 'N':
+                if (type.isPrimitive()) {
+                    throw new IllegalArgumentException("null passed as " + type);
+                }
+                return null;
+            case 'Z':
+                return frame.get() != 0;
+            case 'J': {
+                long v = frame.getLong();
+                if (type == byte.class) return (byte) v;
+                if (type == char.class) return (char) v;
+                if (type == short.class) return (short) v;
+                if (type == int.class) return (int) v;
+                return v;
+            }
+            case 'D': {
+                double v = frame.getDouble();
+                if (type == float.class) return (float) v;
+                return v;
+            }
+            case 'S': {
+                byte[] bytes = new byte[frame.getInt()];
+                frame.get(bytes);
+                if (type == byte[].class) return bytes;
+                if (type == ByteBuffer.class) return ByteBuffer.wrap(bytes).asReadOnlyBuffer();
+                return new String(bytes, StandardCharsets.UTF_8);
+            }
+            case 'A':
+            case 'M': {
+                frame.position(frame.position() - 1);
+                Object value = Bulk.read(frame, 0);
+                if (type == String[].class) return Bulk.toStrings((List<?>) value);
+                if (type.isArray() && type.getComponentType().isPrimitive()) {
+                    return Bulk.toArray((List<?>) value, type.getComponentType());
+                }
+                return value;
+            }
+            default:
+                throw new IllegalArgumentException("unknown value tag: " + tag);
+        }
+    }
+
+    private static void writeValue(DataOutputStream out, Object value, Class<?> type) throws IOException {
+        if (type == void.class) {
+            out.writeByte('V');
+        } else if (value == null) {
+            out.writeByte('N');
+        } else if (type == boolean.class) {
+            out.writeByte('Z');
+            out.writeByte((Boolean) value ? 1 : 0);
+        } else if (type == char.class) {
+            out.writeByte('J');
+            out.writeLong((Character) value);
+        } else if (type == float.class || type == double.class) {
+            out.writeByte('D');
+            out.writeDouble(((Number) value).doubleValue());
+        } else if (type.isPrimitive()) {
+            out.writeByte('J');
+            out.writeLong(((Number) value).longValue());
+        } else if (value instanceof String || value instanceof byte[]) {
+            byte[] bytes = value instanceof String
+                    ? ((String) value).getBytes(StandardCharsets.UTF_8) : (byte[]) value;
+            out.writeByte('S');
+            out.writeInt(bytes.length);
+            out.write(bytes);
+        } else if (value instanceof String[] || (type.isArray() && type.getComponentType().isPrimitive())) {
+            Bulk.write(out, value, 0);
+        } else {
+            throw new IllegalArgumentException("unsupported return value: " + value.getClass().getName());
+        }
+    }
+}
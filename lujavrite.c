@@ -13,9 +13,36 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <dlfcn.h>
+#include <glob.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include <jni.h>
 
@@ -23,127 +50,6300 @@
 #include <lualib.h>
 #include <lauxlib.h>
 
-static JNIEnv *J;
+static JavaVM *jvm;
+static __thread JNIEnv *J;
+static pthread_key_t detach_key;
+static pthread_once_t detach_key_once = PTHREAD_ONCE_INIT;
+/* Lua state calling Java in this thread, which Lua callbacks run in,
+   and nesting depth of callbacks running in it. */
+static __thread lua_State *callback_state;
+static __thread int callback_depth;
+static jclass string_class;
+static jclass out_of_memory_error_class;
+static jclass illegal_argument_exception_class;
+static jclass illegal_state_exception_class;
+static jclass byte_buffer_class;
+static jclass byte_array_class;
+static jclass string_writer_class;
+static jclass print_writer_class;
+static jmethodID as_read_only_buffer;
+static jmethodID boolean_boolean_value;
+static jmethodID number_long_value;
+static jmethodID number_double_value;
+static jmethodID object_to_string;
+static jmethodID class_get_name;
+static jmethodID throwable_get_message;
+static jmethodID throwable_print_stack_trace;
+static jmethodID string_writer_init;
+static jmethodID print_writer_init;
+static jmethodID method_get_parameter_types;
+static jclass file_class;
+static jclass url_class;
+static jclass url_class_loader_class;
+static jmethodID file_init;
+static jmethodID file_to_uri;
+static jmethodID uri_to_url;
+static jmethodID url_class_loader_init;
+static jmethodID class_loader_load_class;
+
+/* Set when calls are forwarded to JVM server, see below. */
+static int server_mode;
+/* Set once JVM is destroyed by shutdown(), read without taking lock. */
+static int jvm_shut_down;
+
+/* io.kojan.lujavrite.Bulk, resolved on first use by init_bulk(). */
+static jclass bulk_class;
+static jmethodID bulk_list;
+static jmethodID bulk_map;
+static jmethodID bulk_strings;
+static jmethodID bulk_pack;
+static jmethodID bulk_decode;
+static jmethodID bulk_iterator;
+static jmethodID bulk_next;
+static int bulk_ready;
+static pthread_mutex_t bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_ARGS 255
+
+/**
+ * Parsed method signature.
+ *
+ * Argument and return types are stored as single-character codes:
+ * JNI primitive type codes ('Z', 'B', 'C', 'S', 'I', 'J', 'F', 'D' and
+ * 'V' for void), 'T' for java.lang.String, 'N' for java.nio.ByteBuffer,
+ * 'l' for java.util.List and java.util.Collection, 'm' for java.util.Map,
+ * 'L' for any other class, 'b' for byte[], 's' for String[], 'h', 'i',
+ * 'j', 'f' and 'd' for short[], int[], long[], float[] and double[], and
+ * '[' for other arrays.
+ */
+struct signature {
+  int nargs;
+  char ret;
+  char args[MAX_ARGS];
+};
+
+#define METHOD_STATIC 0
+#define METHOD_INSTANCE 1
+#define METHOD_CONSTRUCTOR 2
+
+/**
+ * Resolved method of given kind together with its parsed signature and
+ * call statistics, which are looked up by key on the first call
+ * recorded and may be NULL until then.  For methods taking objects
+ * other than String, ByteBuffer and byte[], param_types holds Class[]
+ * of parameter types, used to check object handles passed as
+ * arguments.  Method handles may also have result cache, see
+ * memoize().
+ */
+struct method {
+  int kind;
+  jclass cls;
+  jmethodID id;
+  struct signature sig;
+  jobjectArray param_types;
+  struct method_stats *stats;
+  const char *key;
+  size_t key_len;
+  int key_owned;
+  struct memo *memo;
+};
+
+/**
+ * Java object handle.  Class of the object is only looked up when its
+ * instance methods are first called.  Handles of Lua callbacks also
+ * hold id of the callback function, which is released together with
+ * the handle.
+ */
+struct object {
+  jobject ref;
+  jclass cls;
+  lua_Integer callback;
+};
+
+/**
+ * Handle of class loader created by loader().  Methods of its classes
+ * are cached under its id, which is never reused.
+ */
+struct loader {
+  jobject ref;
+  lua_Integer id;
+};
+
+/**
+ * Method resolution cache entry.
+ *
+ * Entries are keyed by class name, method name and method signature,
+ * stored back to back as NUL-separated strings in key, followed by id
+ * of class loader for classes loaded by loader().  Entries are
+ * reference counted: the cache holds one reference and every call
+ * using the entry another, so that flushing the cache, even from a
+ * callback run by such call, only frees entries once they are unused.
+ */
+struct cache_entry {
+  struct cache_entry *next;
+  unsigned long hash;
+  size_t key_len;
+  int refs;
+  lua_Integer loader;
+  struct method method;
+  char key[];
+};
+
+static struct cache_entry **method_cache;
+static size_t method_cache_size;
+static size_t method_cache_count;
+static pthread_mutex_t method_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Parse single field descriptor, storing its type code in *type.
+ * Returns pointer past the end of descriptor, or NULL if it is invalid.
+ */
+static const char *
+parse_type(const char *p, char *type)
+{
+  switch (*p) {
+  case 'Z': case 'B': case 'C': case 'S': case 'I': case 'J': case 'F': case 'D':
+    *type = *p;
+    return p + 1;
+  case 'L': {
+    const char *end = strchr(p, ';');
+    if (end == NULL || end == p + 1) {
+      return NULL;
+    }
+    static const struct {
+      const char *descriptor;
+      char type;
+    } known[] = {
+      {"Ljava/lang/String;", 'T'},
+      {"Ljava/nio/ByteBuffer;", 'N'},
+      {"Ljava/util/List;", 'l'},
+      {"Ljava/util/Collection;", 'l'},
+      {"Ljava/util/Map;", 'm'},
+    };
+    *type = 'L';
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+      size_t len = strlen(known[i].descriptor);
+      if ((size_t)(end - p + 1) == len && strncmp(p, known[i].descriptor, len) == 0) {
+        *type = known[i].type;
+      }
+    }
+    return end + 1;
+  }
+  case '[': {
+    char elem;
+    const char *q = p + 1;
+    while (*q == '[') {
+      q++;
+    }
+    q = parse_type(q, &elem);
+    if (q == NULL) {
+      return NULL;
+    }
+    if (q == p + 2 && strchr("BSIJFD", elem) != NULL) {
+      *type = "bhijfd"[strchr("BSIJFD", elem) - "BSIJFD"];
+    }
+    else if (elem == 'T' && p[1] == 'L') {
+      *type = 's';
+    }
+    else {
+      *type = '[';
+    }
+    return q;
+  }
+  default:
+    return NULL;
+  }
+}
+
+/**
+ * Parse method signature, eg. "(Ljava/lang/String;I)V".
+ * Returns 0 on success, -1 if signature is malformed.
+ */
+static int
+parse_signature(const char *p, struct signature *sig)
+{
+  if (*p++ != '(') {
+    return -1;
+  }
+  sig->nargs = 0;
+  while (*p != ')') {
+    if (sig->nargs == MAX_ARGS || (p = parse_type(p, &sig->args[sig->nargs])) == NULL) {
+      return -1;
+    }
+    sig->nargs++;
+  }
+  p++;
+  if (*p == 'V') {
+    sig->ret = 'V';
+    p++;
+  }
+  else if ((p = parse_type(p, &sig->ret)) == NULL) {
+    return -1;
+  }
+  return *p == '\0' ? 0 : -1;
+}
+
+static unsigned long
+hash_key(const char *key, size_t len)
+{
+  /* FNV-1a */
+  unsigned long h = 2166136261UL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+static int
+grow_method_cache(void)
+{
+  size_t new_size = method_cache_size ? 2 * method_cache_size : 64;
+  struct cache_entry **new_cache = calloc(new_size, sizeof(*new_cache));
+  if (new_cache == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < method_cache_size; i++) {
+    struct cache_entry *e = method_cache[i];
+    while (e != NULL) {
+      struct cache_entry *next = e->next;
+      e->next = new_cache[e->hash & (new_size - 1)];
+      new_cache[e->hash & (new_size - 1)] = e;
+      e = next;
+    }
+  }
+  free(method_cache);
+  method_cache = new_cache;
+  method_cache_size = new_size;
+  return 0;
+}
+
+/**
+ * Find cache entry with given key.  Entries of instance methods also
+ * have to match class cls, which is NULL for other methods.
+ */
+static struct cache_entry *
+lookup_method(const char *key, size_t key_len, unsigned long hash, jclass cls)
+{
+  if (method_cache_size != 0) {
+    for (struct cache_entry *e = method_cache[hash & (method_cache_size - 1)]; e != NULL; e = e->next) {
+      if (e->hash == hash && e->key_len == key_len && memcmp(e->key, key, key_len) == 0
+          && (cls == NULL || (*J)->IsSameObject(J, e->method.cls, cls))) {
+        return e;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Per-thread arena for temporary memory needed during a single call:
+ * argument arrays, string conversion buffers and reply buffers.
+ *
+ * Memory is carved from a chain of blocks, so earlier allocations stay
+ * in place when the arena grows.  Allocations are released in LIFO
+ * order with arena_release(), and all at once by arena_reset() at the
+ * start of every call from Lua, which also reclaims memory left behind
+ * by Lua errors.  Reset merges the chain into a single block, so once
+ * the arena has grown to fit the largest call, no further memory is
+ * allocated.
+ */
+#define ARENA_MIN_BLOCK 4096
+
+struct arena_block {
+  struct arena_block *prev;
+  size_t size;
+  size_t used;
+  jvalue data[];
+};
+
+struct arena_mark {
+  struct arena_block *block;
+  size_t used;
+};
+
+static __thread struct arena_block *arena;
+static __thread size_t arena_capacity;
+
+/**
+ * Allocate size bytes, aligned for jvalue, from the arena.
+ * Returns NULL on allocation failure.
+ */
+static void *
+arena_try_alloc(size_t size)
+{
+  size = (size + sizeof(jvalue) - 1) / sizeof(jvalue) * sizeof(jvalue);
+  if (arena == NULL || arena->size - arena->used < size) {
+    /* Each new block at least doubles capacity. */
+    size_t block_size = arena_capacity > ARENA_MIN_BLOCK ? arena_capacity : ARENA_MIN_BLOCK;
+    if (block_size < size) {
+      block_size = size;
+    }
+    struct arena_block *b = malloc(sizeof(*b) + block_size);
+    if (b == NULL) {
+      return NULL;
+    }
+    b->prev = arena;
+    b->size = block_size;
+    b->used = 0;
+    arena = b;
+    arena_capacity += block_size;
+  }
+  void *p = (char *)arena->data + arena->used;
+  arena->used += size;
+  return p;
+}
+
+/**
+ * Allocate size bytes from the arena, raising Lua error on failure.
+ */
+static void *
+arena_alloc(lua_State *L, size_t size)
+{
+  void *p = arena_try_alloc(size);
+  if (p == NULL) {
+    luaL_error(L, "out of memory");
+  }
+  return p;
+}
+
+static struct arena_mark
+arena_mark(void)
+{
+  struct arena_mark m = {arena, arena != NULL ? arena->used : 0};
+  return m;
+}
+
+/**
+ * Release all allocations made since mark was taken.  Blocks added
+ * since then are kept until arena_reset() merges them.
+ */
+static void
+arena_release(struct arena_mark m)
+{
+  for (struct arena_block *b = arena; b != m.block; b = b->prev) {
+    b->used = 0;
+  }
+  if (m.block != NULL) {
+    m.block->used = m.used;
+  }
+}
+
+/**
+ * Release all allocations, merging blocks into one.  Inside Lua
+ * callbacks this does nothing, as the arena is still used by the call
+ * that invoked the callback.
+ */
+static void
+arena_reset(void)
+{
+  if (callback_depth > 0) {
+    return;
+  }
+  if (arena != NULL && arena->prev != NULL) {
+    while (arena != NULL) {
+      struct arena_block *prev = arena->prev;
+      free(arena);
+      arena = prev;
+    }
+    size_t size = arena_capacity;
+    arena_capacity = 0;
+    /* On failure the arena just starts over from an empty chain. */
+    if ((arena = malloc(sizeof(*arena) + size)) != NULL) {
+      arena->prev = NULL;
+      arena->size = size;
+      arena->used = 0;
+      arena_capacity = size;
+    }
+  }
+  else if (arena != NULL) {
+    arena->used = 0;
+  }
+}
+
+static void
+free_arena(void)
+{
+  while (arena != NULL) {
+    struct arena_block *prev = arena->prev;
+    free(arena);
+    arena = prev;
+  }
+  arena_capacity = 0;
+}
+
+/*
+ * Conversion between standard UTF-8 used by Lua and UTF-16 used by
+ * Java strings.
+ *
+ * JNI functions working with modified UTF-8 are avoided, as they
+ * encode NUL and supplementary characters differently from standard
+ * UTF-8 and decode byte by byte.  Runs of ASCII characters, which are
+ * the common case, are converted a vector at a time where the target
+ * supports it.  Invalid UTF-8 sequences and unpaired surrogates are
+ * replaced by U+FFFD.
+ */
+
+/**
+ * Widen leading ASCII characters of s to UTF-16.
+ * Returns number of characters converted.
+ */
+static size_t
+widen_ascii(const unsigned char *s, size_t n, jchar *out)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    if (_mm256_movemask_epi8(v) != 0) {
+      break;
+    }
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+    _mm256_storeu_si256((__m256i *)(out + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    if (_mm_movemask_epi8(v) != 0) {
+      break;
+    }
+    _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+    _mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t v = vld1q_u8(s + i);
+    if (vmaxvq_u8(v) >= 0x80) {
+      break;
+    }
+    vst1q_u16((uint16_t *)(out + i), vmovl_u8(vget_low_u8(v)));
+    vst1q_u16((uint16_t *)(out + i + 8), vmovl_u8(vget_high_u8(v)));
+  }
+#endif
+  for (; i < n && s[i] < 0x80; i++) {
+    out[i] = s[i];
+  }
+  return i;
+}
+
+/**
+ * Narrow leading ASCII characters of UTF-16 string s to bytes.
+ * Returns number of characters converted.
+ */
+static size_t
+narrow_ascii(const jchar *s, size_t n, unsigned char *out)
+{
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + 16));
+    if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_set1_epi16((short)0xFF80))) {
+      break;
+    }
+    /* Packing works within 128-bit lanes, so restore order of quadwords. */
+    __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i *)(out + i), v);
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 8));
+    __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xFF80));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, _mm_setzero_si128())) != 0xFFFF) {
+      break;
+    }
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (; i + 16 <= n; i += 16) {
+    uint16x8_t a = vld1q_u16((const uint16_t *)(s + i));
+    uint16x8_t b = vld1q_u16((const uint16_t *)(s + i + 8));
+    if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80) {
+      break;
+    }
+    vst1q_u8(out + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+  }
+#endif
+  for (; i < n && s[i] < 0x80; i++) {
+    out[i] = (unsigned char)s[i];
+  }
+  return i;
+}
+
+static int
+is_continuation(const unsigned char *s, size_t i, size_t n)
+{
+  return i < n && (s[i] & 0xC0) == 0x80;
+}
+
+/**
+ * Convert UTF-8 string s of length n to UTF-16.  Output buffer must
+ * have room for n characters.  Returns number of characters stored.
+ */
+static size_t
+utf8_to_utf16(const unsigned char *s, size_t n, jchar *out)
+{
+  size_t i = 0, j = 0;
+  while (i < n) {
+    size_t k = widen_ascii(s + i, n - i, out + j);
+    i += k;
+    j += k;
+    if (i == n) {
+      break;
+    }
+    unsigned c = s[i];
+    unsigned long cp = 0xFFFD;
+    size_t len = 1;
+    if (c >= 0xC2 && c <= 0xDF && is_continuation(s, i + 1, n)) {
+      cp = (c & 0x1F) << 6 | (s[i + 1] & 0x3F);
+      len = 2;
+    }
+    else if (c >= 0xE0 && c <= 0xEF && is_continuation(s, i + 1, n) && is_continuation(s, i + 2, n)
+             && (c != 0xE0 || s[i + 1] >= 0xA0) && (c != 0xED || s[i + 1] <= 0x9F)) {
+      cp = (c & 0x0F) << 12 | (s[i + 1] & 0x3F) << 6 | (s[i + 2] & 0x3F);
+      len = 3;
+    }
+    else if (c >= 0xF0 && c <= 0xF4 && is_continuation(s, i + 1, n) && is_continuation(s, i + 2, n)
+             && is_continuation(s, i + 3, n) && (c != 0xF0 || s[i + 1] >= 0x90)
+             && (c != 0xF4 || s[i + 1] <= 0x8F)) {
+      cp = (unsigned long)(c & 0x07) << 18 | (s[i + 1] & 0x3F) << 12 | (s[i + 2] & 0x3F) << 6
+        | (s[i + 3] & 0x3F);
+      len = 4;
+    }
+    i += len;
+    if (cp >= 0x10000) {
+      out[j++] = (jchar)(0xD800 | (cp - 0x10000) >> 10);
+      out[j++] = (jchar)(0xDC00 | (cp & 0x3FF));
+    }
+    else {
+      out[j++] = (jchar)cp;
+    }
+  }
+  return j;
+}
+
+/**
+ * Convert UTF-16 string s of length n to UTF-8.  Output buffer must
+ * have room for 3 * n bytes.  Returns number of bytes stored.
+ */
+static size_t
+utf16_to_utf8(const jchar *s, size_t n, unsigned char *out)
+{
+  size_t i = 0, j = 0;
+  while (i < n) {
+    size_t k = narrow_ascii(s + i, n - i, out + j);
+    i += k;
+    j += k;
+    if (i == n) {
+      break;
+    }
+    unsigned long cp = s[i++];
+    if (cp >= 0xD800 && cp <= 0xDBFF && i < n && s[i] >= 0xDC00 && s[i] <= 0xDFFF) {
+      cp = 0x10000 + ((cp - 0xD800) << 10) + (s[i++] - 0xDC00);
+    }
+    else if (cp >= 0xD800 && cp <= 0xDFFF) {
+      cp = 0xFFFD;
+    }
+    if (cp < 0x800) {
+      out[j++] = 0xC0 | cp >> 6;
+      out[j++] = 0x80 | (cp & 0x3F);
+    }
+    else if (cp < 0x10000) {
+      out[j++] = 0xE0 | cp >> 12;
+      out[j++] = 0x80 | (cp >> 6 & 0x3F);
+      out[j++] = 0x80 | (cp & 0x3F);
+    }
+    else {
+      out[j++] = 0xF0 | cp >> 18;
+      out[j++] = 0x80 | (cp >> 12 & 0x3F);
+      out[j++] = 0x80 | (cp >> 6 & 0x3F);
+      out[j++] = 0x80 | (cp & 0x3F);
+    }
+  }
+  return j;
+}
+
+/**
+ * Create Java string from UTF-8 string of given length, which may
+ * contain embedded NULs.
+ * Returns NULL with Java exception pending on failure.
+ */
+static jstring
+new_string(const char *s, size_t len)
+{
+  struct arena_mark m = arena_mark();
+  jchar *buf = arena_try_alloc(len * sizeof(jchar));
+  if (buf == NULL) {
+    (*J)->ThrowNew(J, out_of_memory_error_class, "out of memory");
+    return NULL;
+  }
+  size_t n = utf8_to_utf16((const unsigned char *)s, len, buf);
+  jstring str = (*J)->NewString(J, buf, (jsize)n);
+  arena_release(m);
+  return str;
+}
+
+/*
+ * Interned strings.
+ *
+ * When enabled with string_cache(), short Lua strings passed as String
+ * arguments are looked up in a bounded LRU cache of global references
+ * to Java strings, so that values passed over and over are neither
+ * allocated nor transcoded again.  Entries are keyed by content rather
+ * than by Lua string address, as addresses differ between Lua states
+ * and are reused once strings are collected.
+ */
+#define STRING_CACHE_MAX_LEN 40
+
+struct string_entry {
+  struct string_entry *next;
+  struct string_entry *lru_prev;
+  struct string_entry *lru_next;
+  unsigned long hash;
+  size_t len;
+  jstring ref;
+  char data[];
+};
+
+static struct string_entry **string_cache_buckets;
+static size_t string_cache_size;
+static size_t string_cache_capacity;
+static size_t string_cache_count;
+static struct string_entry *string_lru_head;
+static struct string_entry *string_lru_tail;
+static pthread_mutex_t string_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+string_lru_unlink(struct string_entry *e)
+{
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  }
+  else {
+    string_lru_head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  }
+  else {
+    string_lru_tail = e->lru_prev;
+  }
+}
+
+static void
+string_lru_push(struct string_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = string_lru_head;
+  if (string_lru_head != NULL) {
+    string_lru_head->lru_prev = e;
+  }
+  else {
+    string_lru_tail = e;
+  }
+  string_lru_head = e;
+}
+
+/**
+ * Remove cache entry, releasing its global reference.  Must be called
+ * with string_cache_lock held.
+ */
+static void
+remove_string_entry(struct string_entry *e)
+{
+  struct string_entry **p = &string_cache_buckets[e->hash & (string_cache_size - 1)];
+  while (*p != e) {
+    p = &(*p)->next;
+  }
+  *p = e->next;
+  string_lru_unlink(e);
+  (*J)->DeleteGlobalRef(J, e->ref);
+  free(e);
+  string_cache_count--;
+}
+
+static struct string_entry *
+find_string_entry(const char *s, size_t len, unsigned long hash)
+{
+  struct string_entry *e = string_cache_buckets[hash & (string_cache_size - 1)];
+  while (e != NULL && (e->hash != hash || e->len != len || memcmp(e->data, s, len) != 0)) {
+    e = e->next;
+  }
+  return e;
+}
+
+/**
+ * Create Java string from Lua string like new_string(), reusing cached
+ * string with the same content if string cache is enabled.
+ * Returns local reference, or NULL with Java exception pending.
+ */
+static jstring
+intern_string(const char *s, size_t len)
+{
+  /* Unlocked check keeps disabled cache almost free, it is repeated
+     below with the lock held. */
+  if (string_cache_capacity == 0 || len > STRING_CACHE_MAX_LEN) {
+    return new_string(s, len);
+  }
+  unsigned long hash = hash_key(s, len);
+  pthread_mutex_lock(&string_cache_lock);
+  struct string_entry *e = string_cache_capacity > 0 ? find_string_entry(s, len, hash) : NULL;
+  if (e != NULL) {
+    string_lru_unlink(e);
+    string_lru_push(e);
+    jstring str = (*J)->NewLocalRef(J, e->ref);
+    pthread_mutex_unlock(&string_cache_lock);
+    return str;
+  }
+  pthread_mutex_unlock(&string_cache_lock);
+
+  jstring str = new_string(s, len);
+  if (str == NULL) {
+    return NULL;
+  }
+  e = malloc(sizeof(*e) + len);
+  if (e == NULL) {
+    return str;
+  }
+  if ((e->ref = (*J)->NewGlobalRef(J, str)) == NULL) {
+    free(e);
+    return str;
+  }
+  e->hash = hash;
+  e->len = len;
+  memcpy(e->data, s, len);
+
+  pthread_mutex_lock(&string_cache_lock);
+  /* Cache may have been resized or filled by other thread meanwhile. */
+  if (string_cache_capacity == 0 || find_string_entry(s, len, hash) != NULL) {
+    (*J)->DeleteGlobalRef(J, e->ref);
+    free(e);
+  }
+  else {
+    struct string_entry **bucket = &string_cache_buckets[hash & (string_cache_size - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    string_lru_push(e);
+    if (++string_cache_count > string_cache_capacity) {
+      remove_string_entry(string_lru_tail);
+    }
+  }
+  pthread_mutex_unlock(&string_cache_lock);
+  return str;
+}
+
+/**
+ * Push Java string onto Lua stack as standard UTF-8.
+ *
+ * The string is converted straight from its UTF-16 characters into
+ * arena buffer and pushed with its explicit length, so it may contain
+ * embedded NULs.  Running out of memory is reported as Java exception
+ * rather than Lua error, so that it can be used with a local frame
+ * pushed.
+ * Returns 0 on success, -1 with Java exception pending on failure.
+ */
+static int
+push_string(lua_State *L, jstring str)
+{
+  struct arena_mark m = arena_mark();
+  jsize len = (*J)->GetStringLength(J, str);
+  unsigned char *buf = arena_try_alloc((size_t)len * 3);
+  if (buf == NULL) {
+    (*J)->ThrowNew(J, out_of_memory_error_class, "lujavrite");
+    return -1;
+  }
+  /* No JNI calls are allowed in critical region, and the conversion
+     makes none. */
+  const jchar *chars = (*J)->GetStringCritical(J, str, NULL);
+  if (chars == NULL) {
+    arena_release(m);
+    return -1;
+  }
+  size_t n = utf16_to_utf8(chars, len, buf);
+  (*J)->ReleaseStringCritical(J, str, chars);
+  lua_pushlstring(L, (const char *)buf, n);
+  arena_release(m);
+  return 0;
+}
+
+/**
+ * Push contents of Java byte[] onto Lua stack as string, reporting
+ * failures like push_string().
+ * Returns 0 on success, -1 with Java exception pending on failure.
+ */
+static int
+push_bytes(lua_State *L, jbyteArray arr)
+{
+  struct arena_mark m = arena_mark();
+  jsize len = (*J)->GetArrayLength(J, arr);
+  char *buf = arena_try_alloc(len);
+  if (buf == NULL) {
+    (*J)->ThrowNew(J, out_of_memory_error_class, "lujavrite");
+    return -1;
+  }
+  void *bytes = (*J)->GetPrimitiveArrayCritical(J, arr, NULL);
+  if (bytes == NULL) {
+    arena_release(m);
+    return -1;
+  }
+  /* No JNI calls are allowed in critical region, so copy into arena
+     buffer, leaving the region before calling into Lua. */
+  memcpy(buf, bytes, len);
+  (*J)->ReleasePrimitiveArrayCritical(J, arr, bytes, JNI_ABORT);
+  lua_pushlstring(L, buf, len);
+  arena_release(m);
+  return 0;
+}
+
+/**
+ * Push Lua error object wrapping Java exception.
+ *
+ * The object holds a global reference to the exception and provides
+ * its class name and message as fields "class" and "message", and its
+ * stack trace as field "traceback", which is only formatted when first
+ * accessed.  Converted to string, it gives Throwable.toString().
+ */
+static void
+push_exception(lua_State *L, jthrowable exc)
+{
+  jthrowable *e = lua_newuserdatauv(L, sizeof(*e), 1);
+  *e = (*J)->NewGlobalRef(J, exc);
+  luaL_setmetatable(L, "lujavrite.exception");
+}
+
+/**
+ * Clear pending Java exception and raise it as Lua error.
+ */
+static int
+raise_exception(lua_State *L)
+{
+  jthrowable exc = (*J)->ExceptionOccurred(J);
+  if (exc == NULL) {
+    return luaL_error(L, "JNI call failed");
+  }
+  (*J)->ExceptionClear(J);
+  push_exception(L, exc);
+  (*J)->DeleteLocalRef(J, exc);
+  return lua_error(L);
+}
+
+/**
+ * Pop local frame and raise pending Java exception as Lua error, or
+ * raise error with given message if there is no pending exception.
+ *
+ * Lua errors longjmp out of C code, so frames must be popped before
+ * raising them.  This is used for failures inside local frames, except
+ * in functions run by run_in_frame().
+ */
+static int
+pop_frame_and_raise(lua_State *L, const char *msg)
+{
+  jthrowable exc = (*J)->ExceptionOccurred(J);
+  (*J)->ExceptionClear(J);
+  exc = (*J)->PopLocalFrame(J, exc);
+  if (exc == NULL) {
+    return luaL_error(L, "%s", msg != NULL ? msg : "JNI call failed");
+  }
+  push_exception(L, exc);
+  (*J)->DeleteLocalRef(J, exc);
+  return lua_error(L);
+}
+
+/*
+ * Per-method call statistics, collected while enabled with
+ * enable_stats().
+ *
+ * Entries are keyed the same way as method cache entries, but they are
+ * never freed, so they survive cache flushes and methods can keep
+ * pointers to them.  Latencies are recorded in log-linear histogram:
+ * values are bucketed by their most significant bit and STATS_SUB_BITS
+ * bits following it, which bounds relative error of percentiles by
+ * 1/2^STATS_SUB_BITS.
+ */
+#define STATS_SUB_BITS 3
+#define STATS_BUCKETS (64 << STATS_SUB_BITS)
+#define STATS_TABLE_SIZE 256
+
+struct method_stats {
+  struct method_stats *next;
+  unsigned long hash;
+  size_t key_len;
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t marshal_ns;
+  uint64_t call_ns;
+  uint64_t result_ns;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t histogram[STATS_BUCKETS];
+  char key[];
+};
+
+static int stats_enabled;
+static struct method_stats *stats_table[STATS_TABLE_SIZE];
+static size_t stats_count;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+clear_stats(struct method_stats *s)
+{
+  memset(&s->count, 0, sizeof(*s) - offsetof(struct method_stats, count));
+  s->min_ns = UINT64_MAX;
+}
+
+/**
+ * Find statistics entry for given method cache key, creating it if
+ * needed.  Returns NULL if entry can't be allocated, in which case the
+ * method is not instrumented.
+ */
+static struct method_stats *
+find_stats(const char *key, size_t key_len, unsigned long hash)
+{
+  pthread_mutex_lock(&stats_lock);
+  struct method_stats *s = stats_table[hash % STATS_TABLE_SIZE];
+  while (s != NULL && (s->hash != hash || s->key_len != key_len || memcmp(s->key, key, key_len) != 0)) {
+    s = s->next;
+  }
+  if (s == NULL && (s = malloc(sizeof(*s) + key_len)) != NULL) {
+    clear_stats(s);
+    s->hash = hash;
+    s->key_len = key_len;
+    memcpy(s->key, key, key_len);
+    s->next = stats_table[hash % STATS_TABLE_SIZE];
+    stats_table[hash % STATS_TABLE_SIZE] = s;
+    stats_count++;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  return s;
+}
+
+static int
+stats_bucket(uint64_t ns)
+{
+  if (ns < (1 << STATS_SUB_BITS)) {
+    return (int)ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - STATS_SUB_BITS;
+  return ((shift + 1) << STATS_SUB_BITS) | (int)((ns >> shift) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+/**
+ * Get highest value, in nanoseconds, that falls into given bucket.
+ */
+static uint64_t
+stats_bucket_limit(int bucket)
+{
+  if (bucket < (1 << STATS_SUB_BITS)) {
+    return (uint64_t)bucket;
+  }
+  int shift = (bucket >> STATS_SUB_BITS) - 1;
+  uint64_t low = (uint64_t)((1 << STATS_SUB_BITS) | (bucket & ((1 << STATS_SUB_BITS) - 1))) << shift;
+  return low + (((uint64_t)1 << shift) - 1);
+}
+
+static uint64_t
+ns_between(const struct timespec *a, const struct timespec *b)
+{
+  return (uint64_t)(b->tv_sec - a->tv_sec) * 1000000000 + (uint64_t)b->tv_nsec - (uint64_t)a->tv_nsec;
+}
+
+/**
+ * Record completed call.  Timestamps are taken at call start, after
+ * argument conversion, after the JNI call and after result conversion.
+ */
+static void
+record_stats(struct method_stats *s, const struct timespec t[4], size_t bytes_in, size_t bytes_out)
+{
+  uint64_t total = ns_between(&t[0], &t[3]);
+  pthread_mutex_lock(&stats_lock);
+  s->count++;
+  s->total_ns += total;
+  if (total < s->min_ns) {
+    s->min_ns = total;
+  }
+  if (total > s->max_ns) {
+    s->max_ns = total;
+  }
+  s->marshal_ns += ns_between(&t[0], &t[1]);
+  s->call_ns += ns_between(&t[1], &t[2]);
+  s->result_ns += ns_between(&t[2], &t[3]);
+  s->bytes_in += bytes_in;
+  s->bytes_out += bytes_out;
+  s->histogram[stats_bucket(total)]++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Get parameter types of method, as global reference to Class[].
+ * Returns NULL with Java exception pending on failure.
+ */
+static jobjectArray
+get_param_types(jclass cls, jmethodID id, jboolean is_static)
+{
+  jobject reflected = (*J)->ToReflectedMethod(J, cls, id, is_static);
+  if (reflected == NULL) {
+    return NULL;
+  }
+  jobjectArray types = (*J)->CallObjectMethodA(J, reflected, method_get_parameter_types, NULL);
+  (*J)->DeleteLocalRef(J, reflected);
+  if (types == NULL) {
+    return NULL;
+  }
+  jobjectArray ref = (*J)->NewGlobalRef(J, types);
+  (*J)->DeleteLocalRef(J, types);
+  return ref;
+}
+
+/**
+ * Check whether method takes or returns types converted by Bulk.
+ */
+static int
+uses_bulk(const struct signature *sig)
+{
+  if (sig->ret == 's') {
+    return 1;
+  }
+  for (int i = 0; i < sig->nargs; i++) {
+    if (sig->args[i] == 'l' || sig->args[i] == 'm' || sig->args[i] == 's') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int
+has_object_params(const struct signature *sig)
+{
+  for (int i = 0; i < sig->nargs; i++) {
+    if (strchr("Llms[hijfd", sig->args[i]) != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Copy resolved method, giving the copy its own global references.
+ */
+static void
+copy_method(struct method *dst, const struct method *src)
+{
+  *dst = *src;
+  dst->memo = NULL;
+  dst->stats = __atomic_load_n(&src->stats, __ATOMIC_ACQUIRE);
+  /* The copy may outlive cache entry holding the key. */
+  char *key = malloc(src->key_len);
+  if (key != NULL) {
+    memcpy(key, src->key, src->key_len);
+  }
+  dst->key = key;
+  dst->key_len = key != NULL ? src->key_len : 0;
+  dst->key_owned = 1;
+  dst->cls = (*J)->NewGlobalRef(J, src->cls);
+  if (src->param_types != NULL) {
+    dst->param_types = (*J)->NewGlobalRef(J, src->param_types);
+  }
+}
+
+/**
+ * Delete global references held by resolved method.
+ */
+static void
+release_method(struct method *m)
+{
+  (*J)->DeleteGlobalRef(J, m->cls);
+  if (m->param_types != NULL) {
+    (*J)->DeleteGlobalRef(J, m->param_types);
+  }
+  m->cls = NULL;
+  m->param_types = NULL;
+  if (m->key_owned) {
+    free((char *)m->key);
+    m->key = NULL;
+    m->key_owned = 0;
+  }
+}
+
+/**
+ * Get statistics entry of method, creating it when the first call is
+ * recorded, so that methods called while statistics are disabled cost
+ * nothing.  Statistics of instance methods are kept under the name of
+ * the class they were resolved in.  Returns NULL if the entry can't be
+ * created, in which case the call is not recorded.
+ */
+static struct method_stats *
+method_stats(lua_State *L, struct method *m)
+{
+  struct method_stats *s = __atomic_load_n(&m->stats, __ATOMIC_ACQUIRE);
+  if (s != NULL || m->key == NULL) {
+    return s;
+  }
+  const char *key = m->key;
+  size_t key_len = m->key_len;
+  if (m->kind == METHOD_INSTANCE) {
+    jstring name = (*J)->CallObjectMethodA(J, m->cls, class_get_name, NULL);
+    if (name == NULL || push_string(L, name) != 0) {
+      (*J)->ExceptionClear(J);
+      lua_pushliteral(L, "");
+    }
+    if (name != NULL) {
+      (*J)->DeleteLocalRef(J, name);
+    }
+    luaL_gsub(L, lua_tostring(L, -1), ".", "/");
+    lua_pushlstring(L, m->key, m->key_len);
+    lua_concat(L, 2);
+    key = lua_tolstring(L, -1, &key_len);
+  }
+  s = find_stats(key, key_len, hash_key(key, key_len));
+  if (m->kind == METHOD_INSTANCE) {
+    lua_pop(L, 2);
+  }
+  __atomic_store_n(&m->stats, s, __ATOMIC_RELEASE);
+  return s;
+}
+
+/*
+ * Entries returned by resolve_method() are pinned for the current
+ * thread until unpin_method() is called.  Lua errors may skip that, but
+ * a thread calling resolve_method() outside of callbacks can't be using
+ * any entry, so its pins left behind are released then.
+ */
+static __thread struct cache_entry **pins;
+static __thread size_t pin_count;
+static __thread size_t pin_capacity;
+
+/**
+ * Drop reference to cache entry, freeing it if it was the last one.
+ */
+static void
+release_entry(struct cache_entry *e)
+{
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    release_method(&e->method);
+    free(e);
+  }
+}
+
+static void
+release_pins(void)
+{
+  while (pin_count > 0) {
+    release_entry(pins[--pin_count]);
+  }
+}
+
+/**
+ * Make room for one more pin, raising Lua error on failure.
+ */
+static void
+reserve_pin(lua_State *L)
+{
+  if (pin_count == pin_capacity) {
+    size_t capacity = pin_capacity ? 2 * pin_capacity : 16;
+    struct cache_entry **p = realloc(pins, capacity * sizeof(*p));
+    if (p == NULL) {
+      luaL_error(L, "out of memory");
+    }
+    pins = p;
+    pin_capacity = capacity;
+  }
+}
+
+/**
+ * Pin entry found in the cache.  Must be called with cache locked and
+ * room for the pin reserved.
+ */
+static struct method *
+pin_entry(struct cache_entry *e)
+{
+  __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+  pins[pin_count++] = e;
+  return &e->method;
+}
+
+/**
+ * Release method returned by resolve_method() once it is not used.
+ */
+static void
+unpin_method(struct method *m)
+{
+  struct cache_entry *e = (struct cache_entry *)((char *)m - offsetof(struct cache_entry, method));
+  for (size_t i = pin_count; i-- > 0;) {
+    if (pins[i] == e) {
+      memmove(&pins[i], &pins[i + 1], (pin_count - i - 1) * sizeof(*pins));
+      pin_count--;
+      release_entry(e);
+      return;
+    }
+  }
+}
+
+/**
+ * Find method in the resolution cache, resolving it on cache miss.
+ *
+ * Static methods and constructors are looked up by class name, with
+ * FindClass(), or with loadClass() of given class loader, in which
+ * case they are cached per loader.  Instance methods are looked up in
+ * class cls of the target object, and cached per class, so that each
+ * of its classes gets its own entry.  Constructors are resolved as
+ * methods named <init> returning the constructed object.
+ *
+ * Returned method is pinned and must be released with unpin_method().
+ */
+static struct method *
+resolve_method(lua_State *L, int kind, const char *class_name, jclass cls, const struct loader *loader,
+               const char *method_name, const char *method_signature)
+{
+  if (kind == METHOD_INSTANCE) {
+    class_name = "";
+  }
+  size_t class_len = strlen(class_name);
+  size_t method_len = strlen(method_name);
+  size_t signature_len = strlen(method_signature);
+  size_t name_len = class_len + method_len + signature_len + 3;
+  size_t key_len = name_len + (loader != NULL ? sizeof(loader->id) : 0);
+  struct arena_mark mark = arena_mark();
+  /* Binary class name for loadClass() is stored past the key. */
+  char *key = arena_alloc(L, key_len + (loader != NULL ? class_len + 1 : 0));
+  memcpy(key, class_name, class_len + 1);
+  memcpy(key + class_len + 1, method_name, method_len + 1);
+  memcpy(key + class_len + method_len + 2, method_signature, signature_len + 1);
+  if (loader != NULL) {
+    memcpy(key + name_len, &loader->id, sizeof(loader->id));
+    for (size_t i = 0; i <= class_len; i++) {
+      key[key_len + i] = class_name[i] == '/' ? '.' : class_name[i];
+    }
+  }
+
+  if (callback_depth == 0) {
+    release_pins();
+  }
+  reserve_pin(L);
+  unsigned long hash = hash_key(key, key_len);
+  pthread_mutex_lock(&method_cache_lock);
+  struct cache_entry *e = lookup_method(key, key_len, hash, cls);
+  struct method *m = e != NULL ? pin_entry(e) : NULL;
+  pthread_mutex_unlock(&method_cache_lock);
+  if (m != NULL) {
+    arena_release(mark);
+    return m;
+  }
+
+  /* Resolve without holding the lock, as FindClass() may need to load
+     and initialize the class. */
+  e = malloc(sizeof(*e) + key_len);
+  if (e == NULL) {
+    luaL_error(L, "out of memory");
+  }
+  if (parse_signature(method_signature, &e->method.sig) != 0
+      || (kind == METHOD_CONSTRUCTOR && e->method.sig.ret != 'V')) {
+    free(e);
+    luaL_error(L, "invalid method signature: %s", method_signature);
+  }
+
+  jclass jcls;
+  if (cls != NULL) {
+    jcls = (*J)->NewLocalRef(J, cls);
+  }
+  else if (loader != NULL) {
+    jvalue arg;
+    arg.l = new_string(key + key_len, class_len);
+    jcls = arg.l != NULL ? (*J)->CallObjectMethodA(J, loader->ref, class_loader_load_class, &arg) : NULL;
+    (*J)->DeleteLocalRef(J, arg.l);
+  }
+  else {
+    jcls = (*J)->FindClass(J, class_name);
+  }
+  if (jcls == NULL) {
+    free(e);
+    raise_exception(L);
+  }
+  jmethodID methodId = kind == METHOD_STATIC
+    ? (*J)->GetStaticMethodID(J, jcls, method_name, method_signature)
+    : (*J)->GetMethodID(J, jcls, method_name, method_signature);
+  if (methodId == NULL) {
+    free(e);
+    (*J)->DeleteLocalRef(J, jcls);
+    raise_exception(L);
+  }
+
+  e->method.param_types = NULL;
+  if (has_object_params(&e->method.sig)
+      && (e->method.param_types = get_param_types(jcls, methodId, kind == METHOD_STATIC)) == NULL) {
+    free(e);
+    (*J)->DeleteLocalRef(J, jcls);
+    raise_exception(L);
+  }
+
+  e->hash = hash;
+  e->key_len = key_len;
+  e->refs = 1;
+  e->loader = loader != NULL ? loader->id : 0;
+  e->method.kind = kind;
+  e->method.cls = (*J)->NewGlobalRef(J, jcls);
+  e->method.id = methodId;
+  /* Statistics entry is only created once a call is recorded.  Those
+     of classes loaded by different loaders are kept together. */
+  e->method.stats = NULL;
+  e->method.key = e->key;
+  e->method.key_len = name_len;
+  e->method.key_owned = 0;
+  if (kind == METHOD_CONSTRUCTOR) {
+    e->method.sig.ret = 'L';
+  }
+  memcpy(e->key, key, key_len);
+  (*J)->DeleteLocalRef(J, jcls);
+
+  pthread_mutex_lock(&method_cache_lock);
+  struct cache_entry *other = lookup_method(key, key_len, hash, cls);
+  if (other != NULL) {
+    /* Another thread has resolved the same method meanwhile. */
+    m = pin_entry(other);
+    pthread_mutex_unlock(&method_cache_lock);
+    release_method(&e->method);
+    free(e);
+    arena_release(mark);
+    return m;
+  }
+  /* Failure to grow the table only makes its chains longer. */
+  if (method_cache_count >= method_cache_size && grow_method_cache() != 0 && method_cache_size == 0) {
+    pthread_mutex_unlock(&method_cache_lock);
+    release_method(&e->method);
+    free(e);
+    luaL_error(L, "out of memory");
+  }
+  e->next = method_cache[hash & (method_cache_size - 1)];
+  method_cache[hash & (method_cache_size - 1)] = e;
+  method_cache_count++;
+  m = pin_entry(e);
+  pthread_mutex_unlock(&method_cache_lock);
+  arena_release(mark);
+  return m;
+}
+
+static int
+is_reference(char type)
+{
+  return strchr("ZBCSIJFDV", type) == NULL;
+}
+
+/*
+ * Tagged values.
+ *
+ * Lua tables passed as List, Map or String[] are packed into a single
+ * buffer of tagged values, from which io.kojan.lujavrite.Bulk builds
+ * the whole collection in one call; collections are converted back in
+ * the same way.  The same encoding is used for requests to JVM server.
+ * Values are tagged with 'N' (nil), 'Z' (boolean byte), 'J' (8-byte
+ * integer), 'D' (8-byte double), 'S' (4-byte length and bytes), 'A'
+ * (4-byte count and elements of list) or 'M' (4-byte count and keys and
+ * values of map), all big-endian.
+ */
+
+#define MAX_TABLE_DEPTH 64
+
+static void
+encode_u32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint64_t
+decode_u64(const unsigned char *p, int n)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < n; i++) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+/**
+ * Output of encode_value().  When out is NULL nothing is written, only
+ * the encoded size is counted in n.
+ */
+struct encoder {
+  unsigned char *out;
+  size_t n;
+};
+
+static void
+enc_put(struct encoder *e, const void *p, size_t n)
+{
+  if (e->out != NULL) {
+    memcpy(e->out + e->n, p, n);
+  }
+  e->n += n;
+}
+
+static void
+enc_u8(struct encoder *e, int v)
+{
+  unsigned char c = (unsigned char)v;
+  enc_put(e, &c, 1);
+}
+
+static void
+enc_u32(struct encoder *e, uint32_t v)
+{
+  unsigned char buf[4];
+  encode_u32(buf, v);
+  enc_put(e, buf, sizeof(buf));
+}
+
+static void
+enc_u64(struct encoder *e, uint64_t v)
+{
+  unsigned char buf[8];
+  for (int i = 7; i >= 0; i--) {
+    buf[i] = (unsigned char)v;
+    v >>= 8;
+  }
+  enc_put(e, buf, sizeof(buf));
+}
+
+/**
+ * Count entries of table at given index.  Returns -1 if there are too
+ * many of them.
+ */
+static lua_Integer
+count_entries(lua_State *L, int idx)
+{
+  lua_Integer n = 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    lua_pop(L, 1);
+    n++;
+  }
+  return n > UINT32_MAX ? -1 : n;
+}
+
+/**
+ * Encode Lua value at index idx as tagged value.  Tables are encoded as
+ * lists if kind is 'A' and as maps if kind is 'M'; nested tables are
+ * encoded as lists if they are sequences and as maps otherwise.
+ * Raises Lua error for values that can't be encoded.
+ */
+static void
+encode_value(lua_State *L, int idx, char kind, int depth, struct encoder *e)
+{
+  size_t len;
+  const char *s;
+  double d;
+  uint64_t bits;
+  switch (lua_type(L, idx)) {
+  case LUA_TNIL:
+    enc_u8(e, 'N');
+    return;
+  case LUA_TBOOLEAN:
+    enc_u8(e, 'Z');
+    enc_u8(e, lua_toboolean(L, idx));
+    return;
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, idx)) {
+      enc_u8(e, 'J');
+      enc_u64(e, (uint64_t)lua_tointeger(L, idx));
+    }
+    else {
+      d = lua_tonumber(L, idx);
+      memcpy(&bits, &d, sizeof(bits));
+      enc_u8(e, 'D');
+      enc_u64(e, bits);
+    }
+    return;
+  case LUA_TSTRING:
+    s = lua_tolstring(L, idx, &len);
+    if (len > INT_MAX) {
+      luaL_error(L, "string too long");
+    }
+    enc_u8(e, 'S');
+    enc_u32(e, (uint32_t)len);
+    enc_put(e, s, len);
+    return;
+  case LUA_TTABLE:
+    break;
+  default:
+    luaL_error(L, "can't convert %s to Java", luaL_typename(L, idx));
+  }
+
+  if (depth == MAX_TABLE_DEPTH) {
+    luaL_error(L, "table nested too deeply");
+  }
+  luaL_checkstack(L, 3, NULL);
+  idx = lua_absindex(L, idx);
+  lua_Integer count = count_entries(L, idx);
+  lua_Integer n = (lua_Integer)lua_rawlen(L, idx);
+  if (count < 0 || n > INT_MAX) {
+    luaL_error(L, "table too large");
+  }
+  if (kind == 0) {
+    kind = count == n ? 'A' : 'M';
+  }
+  else if (kind == 'A' && count != n) {
+    luaL_error(L, "table passed as list is not a sequence");
+  }
+  enc_u8(e, kind);
+  if (kind == 'A') {
+    enc_u32(e, (uint32_t)n);
+    for (lua_Integer i = 1; i <= n; i++) {
+      lua_rawgeti(L, idx, i);
+      encode_value(L, -1, 0, depth + 1, e);
+      lua_pop(L, 1);
+    }
+    return;
+  }
+  enc_u32(e, (uint32_t)count);
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0) {
+    encode_value(L, -2, 0, depth + 1, e);
+    encode_value(L, -1, 0, depth + 1, e);
+    lua_pop(L, 1);
+  }
+}
+
+/**
+ * Replace table at index idx, passed as parameter of given type, with
+ * string holding its encoding.  Type 'L' means any object, for which
+ * the table is encoded as list or map depending on its contents.  The
+ * table is walked twice, first to size the encoding and then to write
+ * it to arena memory, so large tables are encoded without
+ * reallocation.
+ */
+static void
+encode_table(lua_State *L, int idx, char type)
+{
+  char kind = type == 'm' ? 'M' : type == 'L' ? 0 : 'A';
+  struct encoder e = {NULL, 0};
+  idx = lua_absindex(L, idx);
+  encode_value(L, idx, kind, 0, &e);
+  struct arena_mark mark = arena_mark();
+  e.out = arena_alloc(L, e.n);
+  e.n = 0;
+  encode_value(L, idx, kind, 0, &e);
+  lua_pushlstring(L, (const char *)e.out, e.n);
+  lua_replace(L, idx);
+  arena_release(mark);
+}
+
+/**
+ * Decode tagged value and push it onto Lua stack, converting lists and
+ * maps to tables.  Doesn't raise Lua errors, so it can be used with a
+ * local frame pushed.
+ * Returns number of values pushed, or -1 if value is malformed.
+ */
+static int
+push_value(lua_State *L, const unsigned char **pp, const unsigned char *end, int depth)
+{
+  const unsigned char *p = *pp;
+  if (p == end) {
+    return -1;
+  }
+  char tag = (char)*p++;
+  uint64_t v;
+  double d;
+  switch (tag) {
+  case 'V':
+    *pp = p;
+    return 0;
+  case 'N':
+    lua_pushnil(L);
+    break;
+  case 'Z':
+    if (end - p < 1) {
+      return -1;
+    }
+    lua_pushboolean(L, *p++);
+    break;
+  case 'J':
+    if (end - p < 8) {
+      return -1;
+    }
+    lua_pushinteger(L, (lua_Integer)(int64_t)decode_u64(p, 8));
+    p += 8;
+    break;
+  case 'D':
+    if (end - p < 8) {
+      return -1;
+    }
+    v = decode_u64(p, 8);
+    memcpy(&d, &v, sizeof(d));
+    lua_pushnumber(L, d);
+    p += 8;
+    break;
+  case 'S':
+    if (end - p < 4) {
+      return -1;
+    }
+    v = decode_u64(p, 4);
+    p += 4;
+    if ((uint64_t)(end - p) < v) {
+      return -1;
+    }
+    lua_pushlstring(L, (const char *)p, (size_t)v);
+    p += v;
+    break;
+  case 'A':
+  case 'M':
+    if (end - p < 4 || depth == MAX_TABLE_DEPTH || !lua_checkstack(L, 3)) {
+      return -1;
+    }
+    v = decode_u64(p, 4);
+    p += 4;
+    /* Every element takes at least one byte, so a bogus count can't
+       make us allocate a huge table. */
+    if ((uint64_t)(end - p) < v) {
+      return -1;
+    }
+    lua_createtable(L, tag == 'A' ? (int)v : 0, tag == 'M' ? (int)v : 0);
+    for (uint64_t k = 1; k <= v; k++) {
+      if (tag == 'A') {
+        if (push_value(L, &p, end, depth + 1) != 1) {
+          lua_pop(L, 1);
+          return -1;
+        }
+        lua_rawseti(L, -2, (lua_Integer)k);
+        continue;
+      }
+      if (push_value(L, &p, end, depth + 1) != 1) {
+        lua_pop(L, 1);
+        return -1;
+      }
+      if (push_value(L, &p, end, depth + 1) != 1) {
+        lua_pop(L, 2);
+        return -1;
+      }
+      /* Lua tables can't have nil or NaN keys. */
+      if (lua_isnil(L, -2) || lua_tonumber(L, -2) != lua_tonumber(L, -2)) {
+        lua_pop(L, 2);
+      }
+      else {
+        lua_rawset(L, -3);
+      }
+    }
+    break;
+  default:
+    return -1;
+  }
+  *pp = p;
+  return 1;
+}
+
+/**
+ * Resolve io.kojan.lujavrite.Bulk on first use, raising Lua error if it
+ * is not available.  It is loaded lazily, so that lujavrite.jar is only
+ * required on class path when tables are converted.
+ */
+static void
+init_bulk(lua_State *L)
+{
+  pthread_mutex_lock(&bulk_lock);
+  if (!bulk_ready) {
+    jclass cls = (*J)->FindClass(J, "io/kojan/lujavrite/Bulk");
+    if (cls != NULL) {
+      bulk_list = (*J)->GetStaticMethodID(J, cls, "list", "(Ljava/nio/ByteBuffer;)Ljava/util/List;");
+      bulk_map = (*J)->GetStaticMethodID(J, cls, "map", "(Ljava/nio/ByteBuffer;)Ljava/util/Map;");
+      bulk_strings = (*J)->GetStaticMethodID(J, cls, "strings", "(Ljava/nio/ByteBuffer;)[Ljava/lang/String;");
+      bulk_pack = (*J)->GetStaticMethodID(J, cls, "pack", "(Ljava/lang/Object;)[B");
+      bulk_decode = (*J)->GetStaticMethodID(J, cls, "decode", "(Ljava/nio/ByteBuffer;)Ljava/lang/Object;");
+      bulk_iterator = (*J)->GetStaticMethodID(J, cls, "iterator", "(Ljava/lang/Object;)Ljava/util/Iterator;");
+      bulk_next = (*J)->GetStaticMethodID(J, cls, "next", "(Ljava/util/Iterator;I)[B");
+      if (bulk_list != NULL && bulk_map != NULL && bulk_strings != NULL && bulk_pack != NULL
+          && bulk_decode != NULL && bulk_iterator != NULL && bulk_next != NULL) {
+        bulk_class = (*J)->NewGlobalRef(J, cls);
+        bulk_ready = 1;
+      }
+      (*J)->DeleteLocalRef(J, cls);
+    }
+  }
+  pthread_mutex_unlock(&bulk_lock);
+  if (!bulk_ready) {
+    raise_exception(L);
+  }
+}
+
+/**
+ * Create Java collection from encoding produced by encode_table().
+ * Returns NULL, with Java exception pending on failure.
+ */
+static jobject
+new_collection(char type, const char *str, size_t len)
+{
+  jobject buf = (*J)->NewDirectByteBuffer(J, (void *)str, len);
+  if (buf == NULL) {
+    return NULL;
+  }
+  jmethodID id = type == 'l' ? bulk_list : type == 'm' ? bulk_map : type == 's' ? bulk_strings : bulk_decode;
+  jvalue arg;
+  arg.l = buf;
+  jobject obj = (*J)->CallStaticObjectMethodA(J, bulk_class, id, &arg);
+  (*J)->DeleteLocalRef(J, buf);
+  return obj;
+}
+
+/**
+ * Decode byte[] packed by Bulk and push it onto Lua stack, releasing
+ * the array.  Returns 0 on success, or -1 with Java exception pending
+ * on failure.
+ */
+static int
+push_packed(lua_State *L, jbyteArray arr)
+{
+  struct arena_mark mark = arena_mark();
+  jsize len = (*J)->GetArrayLength(J, arr);
+  unsigned char *p = arena_try_alloc(len);
+  if (p == NULL) {
+    (*J)->DeleteLocalRef(J, arr);
+    (*J)->ThrowNew(J, out_of_memory_error_class, "lujavrite");
+    return -1;
+  }
+  (*J)->GetByteArrayRegion(J, arr, 0, len, (jbyte *)p);
+  (*J)->DeleteLocalRef(J, arr);
+  const unsigned char *q = p;
+  int ret = push_value(L, &q, p + len, 0);
+  arena_release(mark);
+  if (ret != 1) {
+    (*J)->ThrowNew(J, illegal_argument_exception_class, "malformed table encoding");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Convert Java collection, map or array to Lua table and push it onto
+ * Lua stack.  Returns 0 on success, or -1 with Java exception pending
+ * on failure.
+ */
+static int
+push_table(lua_State *L, jobject obj)
+{
+  jvalue arg;
+  arg.l = obj;
+  jbyteArray arr = (*J)->CallStaticObjectMethodA(J, bulk_class, bulk_pack, &arg);
+  if (arr == NULL) {
+    return -1;
+  }
+  return push_packed(L, arr);
+}
+
+/*
+ * Primitive arrays.
+ *
+ * Lua sequences of numbers passed as short[], int[], long[], float[] or
+ * double[] are validated before local frame is pushed, then staged in
+ * arena memory and copied into new Java array with single
+ * Set<Type>ArrayRegion() call, with no JNI calls per element.  Returned
+ * arrays are copied out with single Get<Type>ArrayRegion() call into
+ * arena memory, and from there into table preallocated to the array
+ * length.
+ */
+
+/**
+ * Check that table at index idx is sequence of numbers which fit in
+ * elements of primitive array of given type.
+ */
+static void
+check_array(lua_State *L, int idx, char type)
+{
+  lua_Integer n = (lua_Integer)lua_rawlen(L, idx);
+  luaL_argcheck(L, n <= INT_MAX, idx, "array too long");
+  for (lua_Integer k = 1; k <= n; k++) {
+    int ok;
+    if (lua_rawgeti(L, idx, k) != LUA_TNUMBER) {
+      ok = 0;
+    }
+    else if (type == 'f') {
+      lua_Number v = lua_tonumber(L, -1);
+      ok = !isfinite(v) || (v >= -FLT_MAX && v <= FLT_MAX);
+    }
+    else if (type == 'd') {
+      ok = 1;
+    }
+    else {
+      int isint;
+      lua_Integer v = lua_tointegerx(L, -1, &isint);
+      ok = isint && (type == 'j'
+                     || (type == 'i' && v >= -2147483647 - 1 && v <= 2147483647)
+                     || (type == 'h' && v >= -32768 && v <= 32767));
+    }
+    lua_pop(L, 1);
+    if (!ok) {
+      luaL_argerror(L, idx, lua_pushfstring(L, "invalid array element #%d", (int)k));
+    }
+  }
+}
+
+/**
+ * Create Java array from table at index idx, already validated by
+ * check_array().  Returns NULL with Java exception pending on failure.
+ */
+static jarray
+new_primitive_array(lua_State *L, char type, int idx)
+{
+  static const size_t elem_size[] = {
+    sizeof(jshort), sizeof(jint), sizeof(jlong), sizeof(jfloat), sizeof(jdouble),
+  };
+  jsize n = (jsize)lua_rawlen(L, idx);
+  struct arena_mark mark = arena_mark();
+  void *p = arena_try_alloc((size_t)n * elem_size[strchr("hijfd", type) - "hijfd"]);
+  if (p == NULL) {
+    (*J)->ThrowNew(J, out_of_memory_error_class, "lujavrite");
+    return NULL;
+  }
+  for (jsize k = 0; k < n; k++) {
+    lua_rawgeti(L, idx, k + 1);
+    switch (type) {
+    case 'h': ((jshort *)p)[k] = (jshort)lua_tointeger(L, -1); break;
+    case 'i': ((jint *)p)[k] = (jint)lua_tointeger(L, -1); break;
+    case 'j': ((jlong *)p)[k] = (jlong)lua_tointeger(L, -1); break;
+    case 'f': ((jfloat *)p)[k] = (jfloat)lua_tonumber(L, -1); break;
+    default: ((jdouble *)p)[k] = (jdouble)lua_tonumber(L, -1); break;
+    }
+    lua_pop(L, 1);
+  }
+  jarray arr;
+  switch (type) {
+  case 'h':
+    if ((arr = (*J)->NewShortArray(J, n)) != NULL) {
+      (*J)->SetShortArrayRegion(J, arr, 0, n, p);
+    }
+    break;
+  case 'i':
+    if ((arr = (*J)->NewIntArray(J, n)) != NULL) {
+      (*J)->SetIntArrayRegion(J, arr, 0, n, p);
+    }
+    break;
+  case 'j':
+    if ((arr = (*J)->NewLongArray(J, n)) != NULL) {
+      (*J)->SetLongArrayRegion(J, arr, 0, n, p);
+    }
+    break;
+  case 'f':
+    if ((arr = (*J)->NewFloatArray(J, n)) != NULL) {
+      (*J)->SetFloatArrayRegion(J, arr, 0, n, p);
+    }
+    break;
+  default:
+    if ((arr = (*J)->NewDoubleArray(J, n)) != NULL) {
+      (*J)->SetDoubleArrayRegion(J, arr, 0, n, p);
+    }
+    break;
+  }
+  arena_release(mark);
+  return arr;
+}
+
+/**
+ * Push primitive array of given type as Lua table.  Returns 0 on
+ * success, or -1 with Java exception pending on failure.
+ */
+static int
+push_array(lua_State *L, char type, jarray arr)
+{
+  static const size_t elem_size[] = {
+    sizeof(jshort), sizeof(jint), sizeof(jlong), sizeof(jfloat), sizeof(jdouble),
+  };
+  jsize n = (*J)->GetArrayLength(J, arr);
+  struct arena_mark mark = arena_mark();
+  void *p = arena_try_alloc((size_t)n * elem_size[strchr("hijfd", type) - "hijfd"]);
+  if (p == NULL) {
+    (*J)->ThrowNew(J, out_of_memory_error_class, "lujavrite");
+    return -1;
+  }
+  lua_createtable(L, n, 0);
+  switch (type) {
+  case 'h':
+    (*J)->GetShortArrayRegion(J, arr, 0, n, p);
+    for (jsize k = 0; k < n; k++) {
+      lua_pushinteger(L, ((jshort *)p)[k]);
+      lua_rawseti(L, -2, k + 1);
+    }
+    break;
+  case 'i':
+    (*J)->GetIntArrayRegion(J, arr, 0, n, p);
+    for (jsize k = 0; k < n; k++) {
+      lua_pushinteger(L, ((jint *)p)[k]);
+      lua_rawseti(L, -2, k + 1);
+    }
+    break;
+  case 'j':
+    (*J)->GetLongArrayRegion(J, arr, 0, n, p);
+    for (jsize k = 0; k < n; k++) {
+      lua_pushinteger(L, ((jlong *)p)[k]);
+      lua_rawseti(L, -2, k + 1);
+    }
+    break;
+  case 'f':
+    (*J)->GetFloatArrayRegion(J, arr, 0, n, p);
+    for (jsize k = 0; k < n; k++) {
+      lua_pushnumber(L, ((jfloat *)p)[k]);
+      lua_rawseti(L, -2, k + 1);
+    }
+    break;
+  default:
+    (*J)->GetDoubleArrayRegion(J, arr, 0, n, p);
+    for (jsize k = 0; k < n; k++) {
+      lua_pushnumber(L, ((jdouble *)p)[k]);
+      lua_rawseti(L, -2, k + 1);
+    }
+    break;
+  }
+  arena_release(mark);
+  return 0;
+}
+
+/**
+ * Check Lua argument at index idx against Java parameter type.
+ * Primitive values are converted right away, while objects are only
+ * validated here and created later by to_java_object(), after a local
+ * frame has been pushed.
+ */
+static void
+check_arg(lua_State *L, int idx, char type, jvalue *v)
+{
+  lua_Integer i;
+  switch (type) {
+  case 'Z':
+    luaL_checktype(L, idx, LUA_TBOOLEAN);
+    v->z = lua_toboolean(L, idx) ? JNI_TRUE : JNI_FALSE;
+    break;
+  case 'B':
+    i = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, i >= -128 && i <= 127, idx, "byte value out of range");
+    v->b = (jbyte)i;
+    break;
+  case 'C':
+    i = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, i >= 0 && i <= 0xFFFF, idx, "char value out of range");
+    v->c = (jchar)i;
+    break;
+  case 'S':
+    i = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, i >= -32768 && i <= 32767, idx, "short value out of range");
+    v->s = (jshort)i;
+    break;
+  case 'I':
+    i = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, i >= -2147483647 - 1 && i <= 2147483647, idx, "int value out of range");
+    v->i = (jint)i;
+    break;
+  case 'J':
+    v->j = (jlong)luaL_checkinteger(L, idx);
+    break;
+  case 'F':
+    v->f = (jfloat)luaL_checknumber(L, idx);
+    break;
+  case 'D':
+    v->d = (jdouble)luaL_checknumber(L, idx);
+    break;
+  case 'T':
+  case 'L':
+  case 'N':
+  case 'b':
+    if (!lua_isnoneornil(L, idx) && luaL_testudata(L, idx, "lujavrite.object") == NULL) {
+      size_t len;
+      luaL_checklstring(L, idx, &len);
+      luaL_argcheck(L, len <= INT_MAX, idx, "string too long");
+    }
+    v->l = NULL;
+    break;
+  case 'l':
+  case 'm':
+  case 's':
+    if (lua_istable(L, idx)) {
+      encode_table(L, idx, type);
+    }
+    else if (!lua_isnoneornil(L, idx)) {
+      luaL_checkudata(L, idx, "lujavrite.object");
+    }
+    v->l = NULL;
+    break;
+  case 'h':
+  case 'i':
+  case 'j':
+  case 'f':
+  case 'd':
+    if (lua_istable(L, idx)) {
+      check_array(L, idx, type);
+      if (server_mode) {
+        encode_table(L, idx, 'l');
+      }
+    }
+    else if (!lua_isnoneornil(L, idx)) {
+      luaL_checkudata(L, idx, "lujavrite.object");
+    }
+    v->l = NULL;
+    break;
+  case '[':
+    if (!lua_isnoneornil(L, idx)) {
+      luaL_checkudata(L, idx, "lujavrite.object");
+    }
+    v->l = NULL;
+    break;
+  default:
+    luaL_argerror(L, idx, "unsupported parameter type");
+  }
+}
+
+/**
+ * Create read-only direct ByteBuffer viewing len bytes at addr.
+ */
+static jobject
+new_read_only_buffer(void *addr, size_t len)
+{
+  jobject buf = (*J)->NewDirectByteBuffer(J, addr, len);
+  if (buf == NULL) {
+    return NULL;
+  }
+  jobject ro_buf = (*J)->CallObjectMethodA(J, buf, as_read_only_buffer, NULL);
+  (*J)->DeleteLocalRef(J, buf);
+  return ro_buf;
+}
+
+/**
+ * Check that object passed as i-th argument of method m is instance of
+ * the parameter type, as JNI doesn't check that itself.
+ * Returns 0 on success, or -1 with Java exception pending on failure.
+ */
+static int
+check_object_arg(struct method *m, int i, jobject obj)
+{
+  jclass cls;
+  switch (m->sig.args[i]) {
+  case 'T': cls = string_class; break;
+  case 'N': cls = byte_buffer_class; break;
+  case 'b': cls = byte_array_class; break;
+  default:
+    cls = (*J)->GetObjectArrayElement(J, m->param_types, i);
+    if (cls == NULL) {
+      return -1;
+    }
+  }
+  jboolean ok = (*J)->IsInstanceOf(J, obj, cls);
+  if (m->sig.args[i] != 'T' && m->sig.args[i] != 'N' && m->sig.args[i] != 'b') {
+    (*J)->DeleteLocalRef(J, cls);
+  }
+  if (!ok) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "argument #%d has wrong type", i + 1);
+    (*J)->ThrowNew(J, illegal_argument_exception_class, msg);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Create Java object for Lua value at index idx, passed as i-th
+ * argument of method m and already validated by check_arg().
+ *
+ * Object handles are passed as the objects they refer to.
+ * Strings passed as ByteBuffer are not copied: the returned read-only
+ * direct buffer points straight into Lua string, so it is valid only
+ * for the duration of the call and must not be retained by Java code.
+ * Strings passed as byte[] are copied as they are, without any
+ * transcoding.  Other strings may come from string cache, see
+ * string_cache().  Tables passed as List, Map or String[], already encoded
+ * by check_arg(), are converted by single call to Bulk.
+ * Returns NULL, with Java exception pending on failure.
+ */
+static jobject
+to_java_object(lua_State *L, struct method *m, int i, int idx)
+{
+  char type = m->sig.args[i];
+  if (lua_isnoneornil(L, idx)) {
+    return NULL;
+  }
+  struct object *obj = luaL_testudata(L, idx, "lujavrite.object");
+  if (obj != NULL) {
+    return check_object_arg(m, i, obj->ref) == 0 ? (*J)->NewLocalRef(J, obj->ref) : NULL;
+  }
+  if (lua_istable(L, idx)) {
+    return new_primitive_array(L, type, idx);
+  }
+  size_t len;
+  const char *str = lua_tolstring(L, idx, &len);
+  if (type == 'N') {
+    return new_read_only_buffer((void *)str, len);
+  }
+  if (type == 'l' || type == 'm' || type == 's') {
+    return new_collection(type, str, len);
+  }
+  if (type == 'b') {
+    jbyteArray arr = (*J)->NewByteArray(J, len);
+    if (arr != NULL) {
+      (*J)->SetByteArrayRegion(J, arr, 0, len, (const jbyte *)str);
+    }
+    return arr;
+  }
+  return intern_string(str, len);
+}
+
+/**
+ * Call method using Call<Type>MethodA or CallStatic<Type>MethodA
+ * variant matching its return type, or NewObjectA() for constructors.
+ * Target object obj is ignored for static methods and constructors.
+ */
+static jvalue
+call_method(struct method *m, jobject obj, const jvalue *args)
+{
+  jvalue ret;
+  if (m->kind == METHOD_CONSTRUCTOR) {
+    ret.l = (*J)->NewObjectA(J, m->cls, m->id, args);
+    return ret;
+  }
+  if (m->kind == METHOD_INSTANCE) {
+    switch (m->sig.ret) {
+    case 'V': (*J)->CallVoidMethodA(J, obj, m->id, args); ret.l = NULL; break;
+    case 'Z': ret.z = (*J)->CallBooleanMethodA(J, obj, m->id, args); break;
+    case 'B': ret.b = (*J)->CallByteMethodA(J, obj, m->id, args); break;
+    case 'C': ret.c = (*J)->CallCharMethodA(J, obj, m->id, args); break;
+    case 'S': ret.s = (*J)->CallShortMethodA(J, obj, m->id, args); break;
+    case 'I': ret.i = (*J)->CallIntMethodA(J, obj, m->id, args); break;
+    case 'J': ret.j = (*J)->CallLongMethodA(J, obj, m->id, args); break;
+    case 'F': ret.f = (*J)->CallFloatMethodA(J, obj, m->id, args); break;
+    case 'D': ret.d = (*J)->CallDoubleMethodA(J, obj, m->id, args); break;
+    default: ret.l = (*J)->CallObjectMethodA(J, obj, m->id, args); break;
+    }
+    return ret;
+  }
+  switch (m->sig.ret) {
+  case 'V': (*J)->CallStaticVoidMethodA(J, m->cls, m->id, args); ret.l = NULL; break;
+  case 'Z': ret.z = (*J)->CallStaticBooleanMethodA(J, m->cls, m->id, args); break;
+  case 'B': ret.b = (*J)->CallStaticByteMethodA(J, m->cls, m->id, args); break;
+  case 'C': ret.c = (*J)->CallStaticCharMethodA(J, m->cls, m->id, args); break;
+  case 'S': ret.s = (*J)->CallStaticShortMethodA(J, m->cls, m->id, args); break;
+  case 'I': ret.i = (*J)->CallStaticIntMethodA(J, m->cls, m->id, args); break;
+  case 'J': ret.j = (*J)->CallStaticLongMethodA(J, m->cls, m->id, args); break;
+  case 'F': ret.f = (*J)->CallStaticFloatMethodA(J, m->cls, m->id, args); break;
+  case 'D': ret.d = (*J)->CallStaticDoubleMethodA(J, m->cls, m->id, args); break;
+  default: ret.l = (*J)->CallStaticObjectMethodA(J, m->cls, m->id, args); break;
+  }
+  return ret;
+}
+
+/**
+ * Call method like call_method(), letting Lua callbacks run in Lua
+ * state L while it executes.
+ */
+static jvalue
+call_from_lua(lua_State *L, struct method *m, jobject obj, const jvalue *args)
+{
+  lua_State *outer = callback_state;
+  callback_state = L;
+  jvalue ret = call_method(m, obj, args);
+  callback_state = outer;
+  return ret;
+}
+
+/**
+ * Push handle of Java object onto Lua stack.  The handle holds global
+ * reference to the object, released when the handle is collected.
+ */
+static void
+push_object(lua_State *L, jobject obj)
+{
+  struct object *h = lua_newuserdatauv(L, sizeof(*h), 0);
+  h->ref = (*J)->NewGlobalRef(J, obj);
+  h->cls = NULL;
+  h->callback = 0;
+  luaL_setmetatable(L, "lujavrite.object");
+}
+
+/**
+ * Push Java return value of given type onto Lua stack.
+ * Returns number of values pushed, or -1 on failure, with Java
+ * exception pending if the failure was caused by one.
+ */
+static int
+push_result(lua_State *L, char type, jvalue v)
+{
+  switch (type) {
+  case 'V': return 0;
+  case 'Z': lua_pushboolean(L, v.z); return 1;
+  case 'B': lua_pushinteger(L, v.b); return 1;
+  case 'C': lua_pushinteger(L, v.c); return 1;
+  case 'S': lua_pushinteger(L, v.s); return 1;
+  case 'I': lua_pushinteger(L, v.i); return 1;
+  case 'J': lua_pushinteger(L, v.j); return 1;
+  case 'F': lua_pushnumber(L, v.f); return 1;
+  case 'D': lua_pushnumber(L, v.d); return 1;
+  }
+
+  if ((*J)->IsSameObject(J, v.l, NULL)) {
+    lua_pushnil(L);
+  }
+  else if (type == 'b') {
+    if (push_bytes(L, v.l) != 0) {
+      return -1;
+    }
+  }
+  else if (type == 's') {
+    if (push_table(L, v.l) != 0) {
+      return -1;
+    }
+  }
+  else if (strchr("hijfd", type) != NULL) {
+    if (push_array(L, type, v.l) != 0) {
+      return -1;
+    }
+  }
+  else if (type == 'T' || (*J)->IsInstanceOf(J, v.l, string_class)) {
+    if (push_string(L, v.l) != 0) {
+      return -1;
+    }
+  }
+  else {
+    push_object(L, v.l);
+  }
+  return 1;
+}
+
+/**
+ * Call Lua C function fn with nargs arguments from top of Lua stack, in
+ * protected mode, while local frame is pushed.  Lua errors raised by fn,
+ * including memory errors, pop the frame before they are propagated, so
+ * that fn can convert values into Lua and raise failures freely.
+ * Returns number of values returned by fn.
+ */
+static int
+run_in_frame(lua_State *L, lua_CFunction fn, int nargs)
+{
+  int top = lua_gettop(L) - nargs;
+  if (!lua_checkstack(L, 1)) {
+    (*J)->PopLocalFrame(J, NULL);
+    luaL_error(L, "stack overflow");
+  }
+  lua_pushcfunction(L, fn);
+  lua_insert(L, top + 1);
+  if (lua_pcall(L, nargs, LUA_MULTRET, 0) != LUA_OK) {
+    (*J)->ExceptionClear(J);
+    (*J)->PopLocalFrame(J, NULL);
+    lua_error(L);
+  }
+  return lua_gettop(L) - top;
+}
+
+/**
+ * Java value converted by push_result_in_frame().
+ */
+struct result {
+  char type;
+  jvalue v;
+};
+
+static int
+convert_result(lua_State *L)
+{
+  struct result *r = lua_touserdata(L, 1);
+  lua_pop(L, 1);
+  int nret = push_result(L, r->type, r->v);
+  if (nret < 0) {
+    return (*J)->ExceptionCheck(J) ? raise_exception(L) : luaL_error(L, "unsupported return value");
+  }
+  return nret;
+}
+
+/**
+ * Push Java value of given type like push_result(), while local frame
+ * is pushed.  Failures are raised as Lua errors, after popping the frame.
+ * Returns number of values pushed.
+ */
+static int
+push_result_in_frame(lua_State *L, char type, jvalue v)
+{
+  struct result r = {type, v};
+  if (!lua_checkstack(L, 1)) {
+    (*J)->PopLocalFrame(J, NULL);
+    luaL_error(L, "stack overflow");
+  }
+  lua_pushlightuserdata(L, &r);
+  return run_in_frame(L, convert_result, 1);
+}
+
+/**
+ * Check arguments taken from Lua stack, starting at index base, and
+ * convert primitive ones.  Missing arguments are treated as nil.
+ * Tables are replaced on the stack with their encoding.
+ */
+static void
+check_args(lua_State *L, struct signature *sig, int base, int n, jvalue *args)
+{
+  if (n > sig->nargs) {
+    luaL_error(L, "too many arguments: expected %d, got %d", sig->nargs, n);
+  }
+  if (!server_mode && uses_bulk(sig)) {
+    init_bulk(L);
+  }
+  for (int i = 0; i < sig->nargs; i++) {
+    check_arg(L, base + i, sig->args[i], &args[i]);
+  }
+}
+
+/**
+ * Create Java objects for arguments validated by check_args().
+ * Must be called with a local frame pushed.  Returns 0 on success, or
+ * -1 with Java exception pending on failure.
+ */
+static int
+convert_args(lua_State *L, struct method *m, int base, jvalue *args)
+{
+  struct signature *sig = &m->sig;
+  for (int i = 0; i < sig->nargs; i++) {
+    if (is_reference(sig->args[i])) {
+      args[i].l = to_java_object(L, m, i, base + i);
+      if ((*J)->ExceptionCheck(J)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Count bytes of string arguments passed to Java, for call statistics.
+ */
+static size_t
+args_bytes(lua_State *L, struct signature *sig, int base)
+{
+  size_t n = 0;
+  for (int i = 0; i < sig->nargs; i++) {
+    if (is_reference(sig->args[i]) && lua_type(L, base + i) == LUA_TSTRING) {
+      n += lua_rawlen(L, base + i);
+    }
+  }
+  return n;
+}
+
+/**
+ * Invoke resolved method on object obj, or NULL for static methods and
+ * constructors, with arguments taken from Lua stack, starting at index
+ * base, and push its return value.
+ */
+static int
+invoke(lua_State *L, struct method *m, jobject obj, int base)
+{
+  struct signature *sig = &m->sig;
+  struct arena_mark mark = arena_mark();
+  jvalue *args = arena_alloc(L, sig->nargs * sizeof(jvalue));
+  struct timespec t[4];
+  struct method_stats *stats = __atomic_load_n(&stats_enabled, __ATOMIC_RELAXED) ? method_stats(L, m) : NULL;
+  int timed = stats != NULL;
+  if (timed) {
+    clock_gettime(CLOCK_MONOTONIC, &t[0]);
+  }
+  check_args(L, sig, base, lua_gettop(L) - base + 1, args);
+
+  /* All local references created during the call are released when
+     the frame is popped, so they don't pile up in long-running hosts.
+     Lua errors would leave the frame behind, so everything done inside
+     it reports failures as Java exceptions instead, and the result is
+     converted in protected mode. */
+  if ((*J)->PushLocalFrame(J, sig->nargs + 1) != 0) {
+    raise_exception(L);
+  }
+
+  if (convert_args(L, m, base, args) != 0) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  if (timed) {
+    clock_gettime(CLOCK_MONOTONIC, &t[1]);
+  }
+  jvalue ret = call_from_lua(L, m, obj, args);
+  if ((*J)->ExceptionCheck(J)) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  if (timed) {
+    clock_gettime(CLOCK_MONOTONIC, &t[2]);
+  }
+  int nret = push_result_in_frame(L, sig->ret, ret);
+  (*J)->PopLocalFrame(J, NULL);
+  arena_release(mark);
+  if (timed) {
+    clock_gettime(CLOCK_MONOTONIC, &t[3]);
+    size_t bytes_out = nret > 0 && lua_type(L, -1) == LUA_TSTRING ? lua_rawlen(L, -1) : 0;
+    record_stats(stats, t, args_bytes(L, sig, base), bytes_out);
+  }
+  return nret;
+}
+
+/*
+ * Lua callbacks.
+ *
+ * callback() wraps Lua function in io.kojan.lujavrite.Callback object,
+ * whose native invoke() method is registered with RegisterNatives().
+ * Functions are kept in "lujavrite.callbacks" registry table, keyed by
+ * callback id, until handle of the Callback object is collected.
+ * Callbacks run in callback_state, so Java can only call them while
+ * their Lua state is calling Java on the same thread.  They run in
+ * protected mode, as Lua errors must not unwind Java frames.
+ */
+
+static jclass callback_class;
+static jmethodID callback_init;
+static jclass lua_exception_class;
+static jclass boolean_class;
+static jclass long_class;
+static jclass double_class;
+static jmethodID boolean_value_of;
+static jmethodID long_value_of;
+static jmethodID double_value_of;
+static lua_Integer next_callback_id;
+static int callbacks_ready;
+static pthread_mutex_t callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Arguments and result of callback invocation, passed to run_callback().
+ */
+struct callback_call {
+  jlong id;
+  jobjectArray args;
+  jbyteArray types;
+  jobject result;
+};
+
+/**
+ * Convert Lua value at index idx to Java object returned by callback.
+ * Returns NULL with Java exception pending on failure.
+ */
+static jobject
+to_callback_result(lua_State *L, int idx)
+{
+  jvalue v;
+  struct object *obj;
+  switch (lua_type(L, idx)) {
+  case LUA_TNIL:
+    return NULL;
+  case LUA_TBOOLEAN:
+    v.z = lua_toboolean(L, idx) ? JNI_TRUE : JNI_FALSE;
+    return (*J)->CallStaticObjectMethodA(J, boolean_class, boolean_value_of, &v);
+  case LUA_TNUMBER:
+    if (lua_isinteger(L, idx)) {
+      v.j = (jlong)lua_tointeger(L, idx);
+      return (*J)->CallStaticObjectMethodA(J, long_class, long_value_of, &v);
+    }
+    v.d = (jdouble)lua_tonumber(L, idx);
+    return (*J)->CallStaticObjectMethodA(J, double_class, double_value_of, &v);
+  case LUA_TSTRING: {
+    size_t len;
+    const char *str = lua_tolstring(L, idx, &len);
+    return new_string(str, len);
+  }
+  case LUA_TTABLE: {
+    size_t len;
+    init_bulk(L);
+    encode_table(L, idx, 'L');
+    const char *str = lua_tolstring(L, idx, &len);
+    return new_collection('L', str, len);
+  }
+  }
+  if ((obj = luaL_testudata(L, idx, "lujavrite.object")) != NULL) {
+    return (*J)->NewLocalRef(J, obj->ref);
+  }
+  luaL_error(L, "can't convert %s to Java", luaL_typename(L, idx));
+  return NULL;
+}
+
+/**
+ * Push callback arguments onto Lua stack, converted according to type
+ * codes computed by Callback.java.
+ */
+static void
+push_callback_args(lua_State *L, jobjectArray args, jbyteArray types, int n)
+{
+  struct arena_mark mark = arena_mark();
+  jbyte *type = arena_alloc(L, n);
+  (*J)->GetByteArrayRegion(J, types, 0, n, type);
+  for (int i = 0; i < n; i++) {
+    jobject obj = (*J)->GetObjectArrayElement(J, args, i);
+    switch (type[i]) {
+    case 'N': lua_pushnil(L); break;
+    case 'Z': lua_pushboolean(L, (*J)->CallBooleanMethodA(J, obj, boolean_boolean_value, NULL)); break;
+    case 'J': lua_pushinteger(L, (*J)->CallLongMethodA(J, obj, number_long_value, NULL)); break;
+    case 'D': lua_pushnumber(L, (*J)->CallDoubleMethodA(J, obj, number_double_value, NULL)); break;
+    case 'T':
+      if (push_string(L, obj) != 0) {
+        luaL_error(L, "failed to convert callback argument");
+      }
+      break;
+    default: push_object(L, obj); break;
+    }
+    (*J)->DeleteLocalRef(J, obj);
+  }
+  arena_release(mark);
+}
+
+/**
+ * Call Lua function of callback, in protected mode.
+ */
+static int
+run_callback(lua_State *L)
+{
+  struct callback_call *c = lua_touserdata(L, 1);
+  jsize n = (*J)->GetArrayLength(J, c->args);
+  luaL_checkstack(L, n + 2, "too many callback arguments");
+  lua_getfield(L, LUA_REGISTRYINDEX, "lujavrite.callbacks");
+  if (lua_type(L, -1) != LUA_TTABLE || lua_rawgeti(L, -1, (lua_Integer)c->id) != LUA_TFUNCTION) {
+    return luaL_error(L, "callback has been released or belongs to another Lua state");
+  }
+  push_callback_args(L, c->args, c->types, n);
+  lua_call(L, n, 1);
+  c->result = to_callback_result(L, -1);
+  return 0;
+}
+
+/**
+ * Message handler of callbacks, which adds traceback to error messages
+ * while keeping Java exceptions, so that they can be rethrown.
+ */
+static int
+callback_error_handler(lua_State *L)
+{
+  if (luaL_testudata(L, 1, "lujavrite.exception") != NULL) {
+    return 1;
+  }
+  luaL_traceback(L, L, luaL_tolstring(L, 1, NULL), 1);
+  return 1;
+}
+
+/**
+ * Implementation of native Callback.invoke().
+ */
+static jobject JNICALL
+callback_invoke(JNIEnv *env, jclass cls, jlong id, jobjectArray args, jbyteArray types)
+{
+  (void)cls;
+  /* Java may call the callback from any thread, which has no J then. */
+  lua_State *L = callback_state;
+  if (L == NULL) {
+    (*env)->ThrowNew(env, illegal_state_exception_class,
+                     "Lua callback called outside of call() made by its Lua state");
+    return NULL;
+  }
+  if (!lua_checkstack(L, 3)) {
+    (*env)->ThrowNew(env, out_of_memory_error_class, "Lua stack overflow");
+    return NULL;
+  }
+  struct callback_call c = {id, args, types, NULL};
+  int top = lua_gettop(L);
+  lua_pushcfunction(L, callback_error_handler);
+  lua_pushcfunction(L, run_callback);
+  lua_pushlightuserdata(L, &c);
+  callback_depth++;
+  int status = lua_pcall(L, 1, 0, top + 1);
+  callback_depth--;
+  if (status != LUA_OK && !(*env)->ExceptionCheck(env)) {
+    jthrowable *e = luaL_testudata(L, -1, "lujavrite.exception");
+    if (e != NULL) {
+      (*env)->Throw(env, *e);
+    }
+    else {
+      (*env)->ThrowNew(env, lua_exception_class, lua_isstring(L, -1) ? lua_tostring(L, -1) : "Lua error");
+    }
+  }
+  lua_settop(L, top);
+  if ((*env)->ExceptionCheck(env)) {
+    return NULL;
+  }
+  return c.result;
+}
+
+/**
+ * Register native method of io.kojan.lujavrite.Callback on first use,
+ * raising Lua error if it is not available.
+ */
+static void
+init_callbacks(lua_State *L)
+{
+  static const struct {
+    const char *class_name;
+    jclass *cls;
+    const char *signature;
+    jmethodID *id;
+  } boxes[] = {
+    {"java/lang/Boolean", &boolean_class, "(Z)Ljava/lang/Boolean;", &boolean_value_of},
+    {"java/lang/Long", &long_class, "(J)Ljava/lang/Long;", &long_value_of},
+    {"java/lang/Double", &double_class, "(D)Ljava/lang/Double;", &double_value_of},
+  };
+  static const JNINativeMethod natives[] = {
+    {"invoke", "(J[Ljava/lang/Object;[B)Ljava/lang/Object;", (void *)callback_invoke},
+  };
+  pthread_mutex_lock(&callbacks_lock);
+  int ok = callbacks_ready;
+  if (!ok) {
+    ok = 1;
+    for (size_t i = 0; ok && i < sizeof(boxes) / sizeof(boxes[0]); i++) {
+      jclass cls = (*J)->FindClass(J, boxes[i].class_name);
+      ok = cls != NULL
+        && (*boxes[i].id = (*J)->GetStaticMethodID(J, cls, "valueOf", boxes[i].signature)) != NULL
+        && (*boxes[i].cls = (*J)->NewGlobalRef(J, cls)) != NULL;
+      (*J)->DeleteLocalRef(J, cls);
+    }
+    jclass exc = ok ? (*J)->FindClass(J, "io/kojan/lujavrite/LuaException") : NULL;
+    jclass cls = exc != NULL ? (*J)->FindClass(J, "io/kojan/lujavrite/Callback") : NULL;
+    ok = cls != NULL
+      && (*J)->RegisterNatives(J, cls, natives, 1) == 0
+      && (callback_init = (*J)->GetMethodID(J, cls, "<init>", "(J)V")) != NULL;
+    if (ok) {
+      callback_class = (*J)->NewGlobalRef(J, cls);
+      lua_exception_class = (*J)->NewGlobalRef(J, exc);
+      callbacks_ready = 1;
+    }
+    (*J)->DeleteLocalRef(J, cls);
+    (*J)->DeleteLocalRef(J, exc);
+  }
+  pthread_mutex_unlock(&callbacks_lock);
+  if (!ok) {
+    raise_exception(L);
+  }
+}
+
+static void
+detach_thread(void *arg)
+{
+  (void)arg;
+  free_arena();
+  if (!__atomic_load_n(&jvm_shut_down, __ATOMIC_ACQUIRE)) {
+    release_pins();
+    (*jvm)->DetachCurrentThread(jvm);
+  }
+  free(pins);
+  pins = NULL;
+  pin_count = pin_capacity = 0;
+}
+
+static void
+create_detach_key(void)
+{
+  pthread_key_create(&detach_key, detach_thread);
+}
+
+/**
+ * Get JNIEnv for current thread, attaching it to JVM if needed.
+ *
+ * Threads other than the one that created JVM are attached as daemon
+ * threads on first use, and automatically detached when they exit.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+get_env(void)
+{
+  if (J != NULL) {
+    return 0;
+  }
+  if ((*jvm)->GetEnv(jvm, (void **)&J, JNI_VERSION_1_8) == JNI_OK) {
+    return 0;
+  }
+  if ((*jvm)->AttachCurrentThreadAsDaemon(jvm, (void **)&J, NULL) != JNI_OK) {
+    J = NULL;
+    return -1;
+  }
+  pthread_once(&detach_key_once, create_detach_key);
+  pthread_setspecific(detach_key, J);
+  return 0;
+}
+
+/*
+ * JVM server client.
+ *
+ * When LUJAVRITE_SERVER environment variable names a Unix domain socket
+ * on which io.kojan.lujavrite.Server is listening, init() connects to
+ * it instead of creating in-process JVM, and call() is forwarded to the
+ * server.  Requests and replies are framed as 4-byte big-endian length
+ * followed by payload, see Server.java for the payload format.
+ */
+
+#define SERVER_CALL 1
+#define SERVER_OK 0
+#define SERVER_EXCEPTION 1
+
+static int server_fd = -1;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Connect to JVM server listening on given socket path.
+ * Returns 0 on success, -1 if no server is available.
+ */
+static int
+connect_server(const char *path)
+{
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  server_fd = fd;
+  server_mode = 1;
+  return 0;
+}
+
+static int
+write_full(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+read_full(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void
+add_u8(luaL_Buffer *b, int v)
+{
+  luaL_addchar(b, (char)v);
+}
+
+static void
+add_u64(luaL_Buffer *b, uint64_t v)
+{
+  unsigned char buf[8];
+  for (int i = 7; i >= 0; i--) {
+    buf[i] = (unsigned char)v;
+    v >>= 8;
+  }
+  luaL_addlstring(b, (const char *)buf, sizeof(buf));
+}
+
+static void
+add_bytes(luaL_Buffer *b, const char *s, size_t len)
+{
+  unsigned char buf[4];
+  encode_u32(buf, (uint32_t)len);
+  luaL_addlstring(b, (const char *)buf, sizeof(buf));
+  luaL_addlstring(b, s, len);
+}
+
+/**
+ * Encode argument at given stack index, already validated by
+ * check_arg(), as tagged value.
+ */
+static void
+add_value(lua_State *L, luaL_Buffer *b, int idx, char type, jvalue v)
+{
+  uint64_t bits;
+  switch (type) {
+  case 'Z': add_u8(b, 'Z'); add_u8(b, v.z); return;
+  case 'B': add_u8(b, 'J'); add_u64(b, (uint64_t)(int64_t)v.b); return;
+  case 'C': add_u8(b, 'J'); add_u64(b, v.c); return;
+  case 'S': add_u8(b, 'J'); add_u64(b, (uint64_t)(int64_t)v.s); return;
+  case 'I': add_u8(b, 'J'); add_u64(b, (uint64_t)(int64_t)v.i); return;
+  case 'J': add_u8(b, 'J'); add_u64(b, (uint64_t)v.j); return;
+  case 'F': v.d = v.f; /* fall through */
+  case 'D':
+    memcpy(&bits, &v.d, sizeof(bits));
+    add_u8(b, 'D');
+    add_u64(b, bits);
+    return;
+  }
+  size_t len;
+  const char *s = lua_tolstring(L, idx, &len);
+  if (lua_isnil(L, idx)) {
+    add_u8(b, 'N');
+  }
+  else if (strchr("lmshijfd", type) != NULL) {
+    /* Tables are already encoded by check_arg(). */
+    luaL_addlstring(b, s, len);
+  }
+  else {
+    add_u8(b, 'S');
+    add_bytes(b, s, len);
+  }
+}
+
+/**
+ * Send request frame to server and read reply into arena buffer, which
+ * is stored in *reply.  Returns reply length, or -1 if connection to
+ * server failed, in which case the connection is closed.
+ */
+static ssize_t
+server_roundtrip(const char *req, size_t len, char **reply)
+{
+  unsigned char hdr[4];
+  ssize_t ret = -1;
+  pthread_mutex_lock(&server_lock);
+  if (server_fd >= 0) {
+    encode_u32(hdr, (uint32_t)len);
+    if (write_full(server_fd, hdr, sizeof(hdr)) == 0
+        && write_full(server_fd, req, len) == 0
+        && read_full(server_fd, hdr, sizeof(hdr)) == 0) {
+      size_t reply_len = (size_t)decode_u64(hdr, 4);
+      *reply = arena_try_alloc(reply_len);
+      if (*reply != NULL && read_full(server_fd, *reply, reply_len) == 0) {
+        ret = (ssize_t)reply_len;
+      }
+    }
+    if (ret < 0) {
+      /* Stream position is unknown after partial transfer. */
+      close(server_fd);
+      server_fd = -1;
+    }
+  }
+  pthread_mutex_unlock(&server_lock);
+  return ret;
+}
+
+/**
+ * Raise Lua error with table describing exception thrown by the server.
+ * The table has the same class, message and traceback fields as
+ * in-process exception objects.
+ */
+static int
+raise_remote_exception(lua_State *L, const unsigned char *p, const unsigned char *end)
+{
+  static const char *const fields[] = {"class", "message", "traceback"};
+  lua_createtable(L, 0, 3);
+  for (int i = 0; i < 3; i++) {
+    if (push_value(L, &p, end, 0) != 1) {
+      return luaL_error(L, "malformed reply from JVM server");
+    }
+    lua_setfield(L, -2, fields[i]);
+  }
+  luaL_setmetatable(L, "lujavrite.remote_exception");
+  return lua_error(L);
+}
+
+static int
+remote_exception_tostring(lua_State *L)
+{
+  lua_getfield(L, 1, "class");
+  lua_getfield(L, 1, "message");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+  }
+  else {
+    lua_pushfstring(L, "%s: %s", lua_tostring(L, -2), lua_tostring(L, -1));
+  }
+  return 1;
+}
+
+/**
+ * Forward static call to JVM server.  Arguments are checked against
+ * method signature locally, so that type errors are reported the same
+ * way as with in-process JVM.
+ */
+static int
+remote_call(lua_State *L)
+{
+  const char *class_name = luaL_checkstring(L, 1);
+  const char *method_name = luaL_checkstring(L, 2);
+  const char *method_signature = luaL_checkstring(L, 3);
+
+  struct signature sig;
+  if (parse_signature(method_signature, &sig) != 0) {
+    return luaL_error(L, "invalid method signature: %s", method_signature);
+  }
+  arena_reset();
+  jvalue *args = arena_alloc(L, sig.nargs * sizeof(jvalue));
+  check_args(L, &sig, 4, lua_gettop(L) - 3, args);
+  lua_settop(L, 3 + sig.nargs);
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  add_u8(&b, SERVER_CALL);
+  add_bytes(&b, class_name, strlen(class_name));
+  add_bytes(&b, method_name, strlen(method_name));
+  add_bytes(&b, method_signature, strlen(method_signature));
+  add_u8(&b, sig.nargs);
+  for (int i = 0; i < sig.nargs; i++) {
+    add_value(L, &b, 4 + i, sig.args[i], args[i]);
+  }
+  luaL_pushresult(&b);
+
+  size_t len;
+  const char *req = lua_tolstring(L, -1, &len);
+  char *reply;
+  ssize_t reply_len = server_roundtrip(req, len, &reply);
+  if (reply_len < 0) {
+    return luaL_error(L, "connection to JVM server lost");
+  }
+
+  const unsigned char *p = (const unsigned char *)reply;
+  const unsigned char *end = p + reply_len;
+  if (reply_len > 0 && *p == SERVER_EXCEPTION) {
+    return raise_remote_exception(L, p + 1, end);
+  }
+  int nret;
+  if (reply_len == 0 || *p++ != SERVER_OK || (nret = push_value(L, &p, end, 0)) < 0) {
+    return luaL_error(L, "malformed reply from JVM server");
+  }
+  return nret;
+}
+
+static const struct {
+  const char *class_name;
+  jclass *cls;
+  const char *name;
+  const char *signature;
+  jmethodID *id;
+} builtins[] = {
+  {"java/lang/String", &string_class, NULL, NULL, NULL},
+  {"java/lang/OutOfMemoryError", &out_of_memory_error_class, NULL, NULL, NULL},
+  {"java/lang/IllegalArgumentException", &illegal_argument_exception_class, NULL, NULL, NULL},
+  {"java/lang/IllegalStateException", &illegal_state_exception_class, NULL, NULL, NULL},
+  {"[B", &byte_array_class, NULL, NULL, NULL},
+  {"java/nio/ByteBuffer", &byte_buffer_class, "asReadOnlyBuffer", "()Ljava/nio/ByteBuffer;", &as_read_only_buffer},
+  {"java/lang/Object", NULL, "toString", "()Ljava/lang/String;", &object_to_string},
+  {"java/lang/Boolean", NULL, "booleanValue", "()Z", &boolean_boolean_value},
+  {"java/lang/Number", NULL, "longValue", "()J", &number_long_value},
+  {"java/lang/Number", NULL, "doubleValue", "()D", &number_double_value},
+  {"java/lang/Class", NULL, "getName", "()Ljava/lang/String;", &class_get_name},
+  {"java/lang/Throwable", NULL, "getMessage", "()Ljava/lang/String;", &throwable_get_message},
+  {"java/lang/Throwable", NULL, "printStackTrace", "(Ljava/io/PrintWriter;)V", &throwable_print_stack_trace},
+  {"java/io/StringWriter", &string_writer_class, "<init>", "()V", &string_writer_init},
+  {"java/io/PrintWriter", &print_writer_class, "<init>", "(Ljava/io/Writer;)V", &print_writer_init},
+  {"java/lang/reflect/Executable", NULL, "getParameterTypes", "()[Ljava/lang/Class;", &method_get_parameter_types},
+  {"java/io/File", &file_class, "<init>", "(Ljava/lang/String;)V", &file_init},
+  {"java/io/File", NULL, "toURI", "()Ljava/net/URI;", &file_to_uri},
+  {"java/net/URI", NULL, "toURL", "()Ljava/net/URL;", &uri_to_url},
+  {"java/net/URL", &url_class, NULL, NULL, NULL},
+  {"java/net/URLClassLoader", &url_class_loader_class, "<init>", "([Ljava/net/URL;)V", &url_class_loader_init},
+  {"java/lang/ClassLoader", NULL, "loadClass", "(Ljava/lang/String;)Ljava/lang/Class;", &class_loader_load_class},
+};
+
+/**
+ * Resolve classes and methods used internally.
+ * Returns 0 on success, or -1 with Java exception pending on failure.
+ */
+static int
+init_builtins(void)
+{
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    jclass jcls = (*J)->FindClass(J, builtins[i].class_name);
+    if (jcls == NULL) {
+      return -1;
+    }
+    if (builtins[i].cls != NULL) {
+      *builtins[i].cls = (*J)->NewGlobalRef(J, jcls);
+    }
+    if (builtins[i].id != NULL) {
+      *builtins[i].id = (*J)->GetMethodID(J, jcls, builtins[i].name, builtins[i].signature);
+      if (*builtins[i].id == NULL) {
+        (*J)->DeleteLocalRef(J, jcls);
+        return -1;
+      }
+    }
+    (*J)->DeleteLocalRef(J, jcls);
+  }
+  return 0;
+}
+
+static double
+elapsed_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * JVM creation state.  JVM is created either right away by init(), or
+ * by init_lazy() on first use, optionally in background thread started
+ * in the meantime.  State is JVM_STARTING from the moment an init
+ * function claims creation until the JVM and its builtins are ready,
+ * so that only one thread creates it.  Once the JVM is ready, jvm is
+ * never modified again.
+ */
+
+#define JVM_NONE 0
+#define JVM_DEFERRED 1
+#define JVM_STARTING 2
+#define JVM_READY 3
+#define JVM_FAILED 4
+#define JVM_SHUT_DOWN 5
+
+static int jvm_state;
+static void *libjvm_handle;
+static char jvm_error[256];
+static pthread_mutex_t jvm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jvm_cond = PTHREAD_COND_INITIALIZER;
+
+/* Options recorded by init_lazy(), owned until JVM is created. */
+static char *deferred_path;
+static JavaVMOption *deferred_options;
+static int deferred_n;
+
+/*
+ * libjvm.so discovery.
+ *
+ * When no libjvm path is given to init functions, libjvm.so is looked
+ * up in JAVA_HOME, in JDK of java found on PATH and in JDKs installed
+ * under /usr/lib/jvm, in this order.  Result of the last lookup, which
+ * depends only on contents of /usr/lib/jvm, is cached in
+ * $XDG_CACHE_HOME/lujavrite-libjvm, together with modification times of
+ * /usr/lib/jvm and of the library itself, so that later starts skip the
+ * search unless either of them changes.  The first two lookups are
+ * cheap and done every time, so that changes of JAVA_HOME or PATH take
+ * effect immediately.
+ */
+
+#define JVM_DIR "/usr/lib/jvm"
+#define LIBJVM_SUFFIX "/lib/server/libjvm.so"
+
+/**
+ * Store path of libjvm.so in given Java home into out and check that it
+ * exists.  Returns 0 if it does, -1 otherwise.
+ */
+static int
+libjvm_in_home(const char *home, size_t home_len, char *out, size_t out_len, struct stat *st)
+{
+  while (home_len > 1 && home[home_len - 1] == '/') {
+    home_len--;
+  }
+  if (snprintf(out, out_len, "%.*s%s", (int)home_len, home, LIBJVM_SUFFIX) >= (int)out_len) {
+    return -1;
+  }
+  return stat(out, st) == 0 && S_ISREG(st->st_mode) ? 0 : -1;
+}
+
+/**
+ * Find libjvm.so of JDK providing java command found on PATH.
+ */
+static int
+libjvm_on_path(char *out, size_t out_len, struct stat *st)
+{
+  const char *path = getenv("PATH");
+  char java[PATH_MAX];
+  char real[PATH_MAX];
+  while (path != NULL && *path != '\0') {
+    const char *end = strchr(path, ':');
+    size_t len = end != NULL ? (size_t)(end - path) : strlen(path);
+    if (len > 0 && snprintf(java, sizeof(java), "%.*s/java", (int)len, path) < (int)sizeof(java)
+        && access(java, X_OK) == 0 && realpath(java, real) != NULL) {
+      /* Java home is the parent of bin/java. */
+      char *slash = strrchr(real, '/');
+      if (slash != NULL && slash - real >= 4 && strncmp(slash - 4, "/bin", 4) == 0) {
+        return libjvm_in_home(real, slash - 4 - real, out, out_len, st);
+      }
+      return -1;
+    }
+    path = end != NULL ? end + 1 : NULL;
+  }
+  return -1;
+}
+
+/**
+ * Find libjvm.so in JDKs installed under /usr/lib/jvm, preferring the
+ * newest version.
+ */
+static int
+libjvm_in_jvm_dir(char *out, size_t out_len, struct stat *st)
+{
+  glob_t g;
+  if (glob(JVM_DIR "/*" LIBJVM_SUFFIX, 0, NULL, &g) != 0) {
+    return -1;
+  }
+  const char *best = NULL;
+  for (size_t i = 0; i < g.gl_pathc; i++) {
+    if (best == NULL || strverscmp(g.gl_pathv[i], best) > 0) {
+      best = g.gl_pathv[i];
+    }
+  }
+  int ret = -1;
+  if (best != NULL && strlen(best) < out_len && stat(best, st) == 0) {
+    strcpy(out, best);
+    ret = 0;
+  }
+  globfree(&g);
+  return ret;
+}
+
+static int
+libjvm_cache_path(char *out, size_t out_len)
+{
+  const char *dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && *dir != '\0') {
+    return snprintf(out, out_len, "%s/lujavrite-libjvm", dir) < (int)out_len ? 0 : -1;
+  }
+  const char *home = getenv("HOME");
+  if (home == NULL || *home == '\0') {
+    return -1;
+  }
+  if (snprintf(out, out_len, "%s/.cache", home) >= (int)out_len) {
+    return -1;
+  }
+  mkdir(out, 0700);
+  return snprintf(out, out_len, "%s/.cache/lujavrite-libjvm", home) < (int)out_len ? 0 : -1;
+}
+
+/**
+ * Read cached libjvm path, if the cache is still valid.
+ */
+static int
+read_libjvm_cache(const char *cache, const struct stat *dir_st, char *out, size_t out_len)
+{
+  FILE *f = fopen(cache, "re");
+  if (f == NULL) {
+    return -1;
+  }
+  char line[PATH_MAX + 64];
+  long long dir_sec, lib_sec;
+  long dir_nsec, lib_nsec;
+  int pos = 0;
+  int ret = -1;
+  if (fgets(line, sizeof(line), f) != NULL
+      && sscanf(line, "%lld %ld %lld %ld %n", &dir_sec, &dir_nsec, &lib_sec, &lib_nsec, &pos) == 4
+      && dir_sec == (long long)dir_st->st_mtim.tv_sec && dir_nsec == dir_st->st_mtim.tv_nsec) {
+    char *path = line + pos;
+    path[strcspn(path, "\n")] = '\0';
+    struct stat st;
+    if (*path != '\0' && strlen(path) < out_len && stat(path, &st) == 0
+        && lib_sec == (long long)st.st_mtim.tv_sec && lib_nsec == st.st_mtim.tv_nsec) {
+      strcpy(out, path);
+      ret = 0;
+    }
+  }
+  fclose(f);
+  return ret;
+}
+
+/**
+ * Write libjvm path to cache, replacing the cache file atomically so
+ * that concurrent readers never see partial content.  Failures are
+ * ignored, as the cache is only an optimization.
+ */
+static void
+write_libjvm_cache(const char *cache, const struct stat *dir_st, const char *path, const struct stat *st)
+{
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.%ld", cache, (long)getpid()) >= (int)sizeof(tmp)) {
+    return;
+  }
+  FILE *f = fopen(tmp, "we");
+  if (f == NULL) {
+    return;
+  }
+  int ok = fprintf(f, "%lld %ld %lld %ld %s\n",
+                   (long long)dir_st->st_mtim.tv_sec, (long)dir_st->st_mtim.tv_nsec,
+                   (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec, path) > 0;
+  if (fclose(f) != 0 || !ok || rename(tmp, cache) != 0) {
+    unlink(tmp);
+  }
+}
+
+/**
+ * Find libjvm.so of default JDK and store its path into out.
+ * Returns 0 on success, -1 if no JDK was found.
+ */
+static int
+discover_libjvm(char *out, size_t out_len)
+{
+  struct stat st;
+  const char *java_home = getenv("JAVA_HOME");
+  if (java_home != NULL && *java_home != '\0') {
+    return libjvm_in_home(java_home, strlen(java_home), out, out_len, &st);
+  }
+
+  if (libjvm_on_path(out, out_len, &st) == 0) {
+    return 0;
+  }
+
+  char cache[PATH_MAX];
+  struct stat dir_st;
+  int cached = libjvm_cache_path(cache, sizeof(cache)) == 0;
+  if (stat(JVM_DIR, &dir_st) != 0) {
+    memset(&dir_st, 0, sizeof(dir_st));
+  }
+  if (cached && read_libjvm_cache(cache, &dir_st, out, out_len) == 0) {
+    return 0;
+  }
+  if (libjvm_in_jvm_dir(out, out_len, &st) != 0) {
+    return -1;
+  }
+  if (cached) {
+    write_libjvm_cache(cache, &dir_st, out, &st);
+  }
+  return 0;
+}
+
+/**
+ * Set JVM state, recording error message err if it is not NULL, and
+ * wake up threads waiting for JVM to be created.
+ */
+static void
+set_jvm_state(int state, const char *err)
+{
+  pthread_mutex_lock(&jvm_lock);
+  if (err != NULL) {
+    snprintf(jvm_error, sizeof(jvm_error), "%s", err);
+  }
+  jvm_state = state;
+  pthread_cond_broadcast(&jvm_cond);
+  pthread_mutex_unlock(&jvm_lock);
+}
+
+/**
+ * Claim JVM creation for current thread, changing state from JVM_NONE
+ * to JVM_STARTING, so that other init functions fail and calls wait for
+ * the JVM.  Raises Lua error if JVM has already been initialized.
+ * libjvm path argument at index idx is checked first, since Lua errors
+ * raised later must give up the claim with abandon_jvm().
+ */
+static void
+claim_jvm(lua_State *L, int idx)
+{
+  if (!lua_isnoneornil(L, idx)) {
+    luaL_checkstring(L, idx);
+  }
+  pthread_mutex_lock(&jvm_lock);
+  int claimed = jvm_state == JVM_NONE && !server_mode;
+  if (claimed) {
+    jvm_state = JVM_STARTING;
+  }
+  pthread_mutex_unlock(&jvm_lock);
+  if (!claimed) {
+    luaL_error(L, "JVM has already been initialized");
+  }
+}
+
+/**
+ * Give up JVM creation claimed by claim_jvm() and raise Lua error with
+ * given message.
+ */
+static int
+abandon_jvm(lua_State *L, const char *msg)
+{
+  set_jvm_state(JVM_NONE, NULL);
+  return luaL_error(L, "%s", msg);
+}
+
+/**
+ * Get libjvm path passed as argument at index idx, discovering it into
+ * buf of PATH_MAX bytes if the argument is nil.  Must be called with
+ * JVM creation claimed, which is given up if no JDK can be found.
+ */
+static const char *
+check_libjvm_path(lua_State *L, int idx, char *buf)
+{
+  if (!lua_isnoneornil(L, idx)) {
+    return lua_tostring(L, idx);
+  }
+  if (discover_libjvm(buf, PATH_MAX) != 0) {
+    abandon_jvm(L, "libjvm.so not found, set JAVA_HOME or pass its path");
+  }
+  return buf;
+}
+
+/**
+ * Find libjvm.so of default JDK, in the same way as init functions do
+ * when they are not given libjvm path.
+ *
+ * Returns:
+ * - path to libjvm.so, or nil if it was not found
+ */
+static int
+find_jvm(lua_State *L)
+{
+  char path[PATH_MAX];
+  if (discover_libjvm(path, sizeof(path)) != 0) {
+    lua_pushnil(L);
+  }
+  else {
+    lua_pushstring(L, path);
+  }
+  return 1;
+}
+
+/**
+ * dlopen() libjvm.so and create JVM with given options, attaching
+ * current thread to it.  Returns 0 on success, or -1 with error message
+ * stored in err on failure.
+ */
+static int
+load_jvm(const char *libjvm_path, JavaVMOption *options, int n, jboolean ignore_unrecognized,
+         char *err, size_t err_len)
+{
+  void *libjvm = dlopen(libjvm_path, RTLD_LAZY);
+  if (!libjvm) {
+    snprintf(err, err_len, "dlopen(libjvm.so) error: %s", dlerror());
+    return -1;
+  }
+  jint (JNICALL *JNI_CreateJavaVM)(JavaVM **pvm, void **penv, void *args)
+    = dlsym(libjvm, "JNI_CreateJavaVM");
+  if (!JNI_CreateJavaVM) {
+    snprintf(err, err_len, "dlsym(JNI_CreateJavaVM) error: %s", dlerror());
+    dlclose(libjvm);
+    return -1;
+  }
+
+  JavaVMInitArgs vmArgs;
+  vmArgs.version = JNI_VERSION_1_8;
+  vmArgs.nOptions = n;
+  vmArgs.options = options;
+  vmArgs.ignoreUnrecognized = ignore_unrecognized;
+
+  JavaVM *vm;
+  jint flag = JNI_CreateJavaVM(&vm, (void **)&J, &vmArgs);
+  if (flag != JNI_OK) {
+    J = NULL;
+    snprintf(err, err_len, "failed to create JVM: error %d", (int)flag);
+    dlclose(libjvm);
+    return -1;
+  }
+  jvm = vm;
+  libjvm_handle = libjvm;
+  return 0;
+}
+
+static void
+free_deferred(void)
+{
+  for (int i = 0; i < deferred_n; i++) {
+    free(deferred_options[i].optionString);
+  }
+  free(deferred_options);
+  free(deferred_path);
+  deferred_options = NULL;
+  deferred_path = NULL;
+  deferred_n = 0;
+}
+
+/**
+ * Create JVM with options recorded by init_lazy(), in current thread,
+ * and wake up threads waiting for it.  Must be called after changing
+ * state from JVM_DEFERRED to JVM_STARTING.
+ */
+static void
+start_deferred_jvm(void)
+{
+  char err[sizeof(jvm_error)];
+  int ret = load_jvm(deferred_path, deferred_options, deferred_n, JNI_FALSE, err, sizeof(err));
+  if (ret == 0 && init_builtins() != 0) {
+    (*J)->ExceptionClear(J);
+    snprintf(err, sizeof(err), "failed to resolve builtin classes");
+    ret = -1;
+  }
+  free_deferred();
+  set_jvm_state(ret == 0 ? JVM_READY : JVM_FAILED, ret == 0 ? NULL : err);
+}
+
+static void *
+prewarm_thread(void *arg)
+{
+  (void)arg;
+  start_deferred_jvm();
+  /* Threads calling Java attach themselves, this one is not needed. */
+  if (J != NULL) {
+    (*jvm)->DetachCurrentThread(jvm);
+    J = NULL;
+  }
+  return NULL;
+}
+
+/**
+ * Make sure JVM has been created, creating deferred JVM in current
+ * thread or waiting for background thread to create it, and raising
+ * Lua error if that fails.
+ */
+static void
+wait_jvm(lua_State *L)
+{
+  pthread_mutex_lock(&jvm_lock);
+  while (jvm_state == JVM_DEFERRED || jvm_state == JVM_STARTING) {
+    if (jvm_state == JVM_DEFERRED) {
+      jvm_state = JVM_STARTING;
+      pthread_mutex_unlock(&jvm_lock);
+      start_deferred_jvm();
+      pthread_mutex_lock(&jvm_lock);
+    }
+    else {
+      pthread_cond_wait(&jvm_cond, &jvm_lock);
+    }
+  }
+  int state = jvm_state;
+  pthread_mutex_unlock(&jvm_lock);
+  if (state == JVM_FAILED) {
+    luaL_error(L, "%s", jvm_error);
+  }
+  if (state == JVM_SHUT_DOWN) {
+    luaL_error(L, "JVM has been shut down");
+  }
+  if (state != JVM_READY) {
+    luaL_error(L, "JVM has not been initialized");
+  }
+}
+
+/**
+ * Connect to JVM server if LUJAVRITE_SERVER environment variable names
+ * one.  Returns 0 if connected, -1 otherwise.
+ */
+static int
+try_server(void)
+{
+  const char *server_path = getenv("LUJAVRITE_SERVER");
+  if (server_path == NULL || *server_path == '\0') {
+    return -1;
+  }
+  return connect_server(server_path);
+}
+
+/**
+ * dlopen() libjvm.so passed as argument at index idx and create JVM
+ * with given options, unless JVM server is available, in which case
+ * connect to it instead without looking for libjvm.so.  Pushes time
+ * taken, in seconds.
+ */
+static int
+create_jvm(lua_State *L, int idx, JavaVMOption *options, int n, jboolean ignore_unrecognized)
+{
+  claim_jvm(L, idx);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (try_server() == 0) {
+    set_jvm_state(JVM_NONE, NULL);
+    lua_pushnumber(L, elapsed_since(&start));
+    return 1;
+  }
+
+  char path[PATH_MAX];
+  const char *libjvm_path = check_libjvm_path(L, idx, path);
+  char err[sizeof(jvm_error)];
+  if (load_jvm(libjvm_path, options, n, ignore_unrecognized, err, sizeof(err)) != 0) {
+    return abandon_jvm(L, err);
+  }
+  /* Calls may only use the JVM once builtins are resolved.  It can't be
+     created again, so failing here is final. */
+  if (init_builtins() != 0) {
+    set_jvm_state(JVM_FAILED, "failed to resolve builtin classes");
+    raise_exception(L);
+  }
+  set_jvm_state(JVM_READY, NULL);
+
+  lua_pushnumber(L, elapsed_since(&start));
+  return 1;
+}
+
+/**
+ * Make sure current thread has JNIEnv, raising Lua error if it can't
+ * be obtained.
+ */
+static void
+attach_thread(lua_State *L)
+{
+  if (J != NULL && !__atomic_load_n(&jvm_shut_down, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  if (server_mode) {
+    luaL_error(L, "not supported when connected to JVM server");
+  }
+  wait_jvm(L);
+  if (get_env() != 0) {
+    luaL_error(L, "failed to attach thread to JVM");
+  }
+}
+
+/**
+ * Make sure current thread has JNIEnv for releasing references from
+ * __gc metamethod, without raising Lua errors, which must not escape
+ * finalizers, and without creating deferred JVM.  Returns 0 if there is
+ * no usable JVM, eg. when it has been shut down, in which case there is
+ * nothing left to release.
+ */
+static int
+attach_for_gc(void)
+{
+  if (__atomic_load_n(&jvm_shut_down, __ATOMIC_ACQUIRE) || server_mode) {
+    return 0;
+  }
+  if (J != NULL) {
+    return 1;
+  }
+  pthread_mutex_lock(&jvm_lock);
+  int state = jvm_state;
+  pthread_mutex_unlock(&jvm_lock);
+  return state == JVM_READY && get_env() == 0;
+}
+
+/**
+ * Initialize Java Virtual Machine.
+ *
+ * dlopen() libjvm.so and call JNI_CreateJavaVM() with specified arguments.
+ *
+ * Parameters:
+ * - path to libjvm.so, eg. /usr/lib/jvm/java-17-openjdk/lib/server/libjvm.so,
+ *   or nil to find it with find_jvm()
+ * - zero or more arguments passed to JVM - eg. -Djava.class.path=...
+ *
+ * If LUJAVRITE_SERVER environment variable is set to path of socket
+ * on which JVM server is listening, connect to that server instead and
+ * ignore the parameters, so no JDK needs to be installed.  Falls back
+ * to in-process JVM when no server is listening there.
+ *
+ * Returns:
+ * - time taken to create JVM or connect to server, in seconds
+ */
+static int
+init(lua_State *L)
+{
+  int n = lua_gettop(L) > 1 ? lua_gettop(L) - 1 : 0;
+  arena_reset();
+  JavaVMOption *jvmopt = arena_alloc(L, n * sizeof(JavaVMOption));
+  for (int i = 0; i < n; i++) {
+    jvmopt[i].optionString = (char *)luaL_checkstring(L, i + 2);
+  }
+  return create_jvm(L, 1, jvmopt, n, JNI_FALSE);
+}
+
+/**
+ * Initialize Java Virtual Machine on first use.
+ *
+ * Same as init(), but libjvm.so is only loaded and JVM created when
+ * Java is first called, so that programs which don't end up calling
+ * Java don't pay for JVM startup.  When prewarm is true, JVM creation
+ * starts right away in background thread, and the first call only
+ * waits for it to complete.  Errors are reported by the first call.
+ *
+ * Parameters:
+ * - path to libjvm.so, eg. /usr/lib/jvm/java-17-openjdk/lib/server/libjvm.so,
+ *   or nil to find it with find_jvm()
+ * - whether to start creating JVM in background
+ * - zero or more arguments passed to JVM - eg. -Djava.class.path=...
+ *
+ * Returns:
+ * - nothing
+ */
+static int
+init_lazy(lua_State *L)
+{
+  int prewarm = lua_toboolean(L, 2);
+  int n = lua_gettop(L) > 2 ? lua_gettop(L) - 2 : 0;
+  for (int i = 0; i < n; i++) {
+    luaL_checkstring(L, i + 3);
+  }
+  claim_jvm(L, 1);
+  if (try_server() == 0) {
+    set_jvm_state(JVM_NONE, NULL);
+    return 0;
+  }
+
+  char path[PATH_MAX];
+  const char *libjvm_path = check_libjvm_path(L, 1, path);
+  deferred_path = strdup(libjvm_path);
+  deferred_options = calloc(n ? n : 1, sizeof(JavaVMOption));
+  if (deferred_path == NULL || deferred_options == NULL) {
+    free_deferred();
+    return abandon_jvm(L, "out of memory");
+  }
+  for (; deferred_n < n; deferred_n++) {
+    deferred_options[deferred_n].optionString = strdup(lua_tostring(L, deferred_n + 3));
+    if (deferred_options[deferred_n].optionString == NULL) {
+      free_deferred();
+      return abandon_jvm(L, "out of memory");
+    }
+  }
+
+  if (!prewarm) {
+    set_jvm_state(JVM_DEFERRED, NULL);
+  }
+  else {
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prewarm_thread, NULL) != 0) {
+      /* JVM will be created on first use instead. */
+      set_jvm_state(JVM_DEFERRED, NULL);
+    }
+    pthread_attr_destroy(&attr);
+  }
+  return 0;
+}
+
+/**
+ * JVM options tuned for fast startup of short-lived processes:
+ * class data sharing, C1-only JIT compilation and a small serial heap.
+ */
+static const char *const fast_options[] = {
+  "-Xshare:auto",
+  "-XX:TieredStopAtLevel=1",
+  "-XX:+UseSerialGC",
+  "-XX:-UsePerfData",
+  "-Xms8m",
+};
+
+/**
+ * Initialize Java Virtual Machine with options tuned for fast startup.
+ *
+ * Same as init(), but JVM is started with class data sharing enabled,
+ * JIT compilation limited to C1 and a small serial GC heap.  When
+ * archive path is given, application classes are also shared through
+ * dynamic CDS archive.  If the archive doesn't exist yet, it is dumped
+ * when the JVM exits, so that later runs can map it.  Delete the file
+ * to have it recreated after the class path changes.
+ * JVMs not supporting some of these options ignore them.  Options given
+ * explicitly take precedence over the preset.
+ *
+ * Parameters:
+ * - path to libjvm.so, eg. /usr/lib/jvm/java-17-openjdk/lib/server/libjvm.so,
+ *   or nil to find it with find_jvm()
+ * - path to CDS archive file, or nil to use only default CDS archive
+ * - zero or more arguments passed to JVM - eg. -Djava.class.path=...
+ *
+ * Returns:
+ * - time taken to create JVM, in seconds
+ */
+static int
+init_fast(lua_State *L)
+{
+  const char *archive_path = luaL_optstring(L, 2, NULL);
+  int n_fast = sizeof(fast_options) / sizeof(fast_options[0]);
+  int n_user = lua_gettop(L) > 2 ? lua_gettop(L) - 2 : 0;
+  arena_reset();
+  JavaVMOption *jvmopt = arena_alloc(L, (n_fast + 1 + n_user) * sizeof(JavaVMOption));
+  int n = 0;
+
+  for (int i = 0; i < n_fast; i++) {
+    jvmopt[n++].optionString = (char *)fast_options[i];
+  }
+  if (archive_path != NULL) {
+    /* -XX:+AutoCreateSharedArchive would do this, but only on JDK 19+. */
+    struct stat st;
+    const char *fmt = stat(archive_path, &st) == 0 ? "-XX:SharedArchiveFile=%s" : "-XX:ArchiveClassesAtExit=%s";
+    jvmopt[n++].optionString = (char *)lua_pushfstring(L, fmt, archive_path);
+  }
+  for (int i = 0; i < n_user; i++) {
+    jvmopt[n++].optionString = (char *)luaL_checkstring(L, i + 3);
+  }
+  return create_jvm(L, 1, jvmopt, n, JNI_TRUE);
+}
+
+
+/**
+ * Call static Java function.
+ *
+ * Arguments and return value are converted according to method
+ * signature: boolean maps to Lua boolean, integral types to Lua
+ * integers, float and double to Lua numbers, and String to Lua string.
+ * Returned Strings are converted to standard UTF-8 and returned byte[]
+ * arrays are returned as Lua strings holding raw bytes.
+ * Lua strings passed as ByteBuffer parameters are exposed to Java as
+ * read-only direct buffers without copying, and passed as byte[]
+ * parameters they are copied without transcoding.  Strings and nil can
+ * also be passed as other object types.  Other objects are returned as
+ * object handles, which can be passed back as arguments of matching
+ * type and release the object when garbage collected.  Void methods
+ * return no values.
+ *
+ * Parameters:
+ * - class name, eg. "com/mycompany/MyClass"
+ * - method name, eg. "myMethod"
+ * - method signature, eg. "(Ljava/lang/String;)Ljava/lang/String;"
+ * - zero or more arguments
+ *
+ * Class and method lookups are cached, see flush_cache().
+ * When connected to JVM server, the call is executed by the server,
+ * with exceptions raised as tables with the same fields as exception
+ * objects.
+ *
+ * Returns:
+ * - return value of Java function, if any
+ */
+static int
+call(lua_State *L)
+{
+  if (server_mode) {
+    return remote_call(L);
+  }
+  attach_thread(L);
+  arena_reset();
+  const char *class_name = luaL_checkstring(L, 1);
+  const char *method_name = luaL_checkstring(L, 2);
+  const char *method_signature = luaL_checkstring(L, 3);
+
+  struct method *m = resolve_method(L, METHOD_STATIC, class_name, NULL, NULL, method_name, method_signature);
+  int nret = invoke(L, m, NULL, 4);
+  unpin_method(m);
+  return nret;
+}
+
+static void
+set_count_field(lua_State *L, const char *name, uint64_t n)
+{
+  lua_pushinteger(L, (lua_Integer)n);
+  lua_setfield(L, -2, name);
+}
+
+/*
+ * Memoized method handles.
+ *
+ * Handles of pure methods can be given a bounded LRU cache of results
+ * with memoize().  Arguments and results are stored as tagged values,
+ * so cache hits are served without calling Java.  Only calls with nil,
+ * boolean, number and string arguments are cached, and only results
+ * which can be encoded, ie. not object handles.
+ */
+
+struct memo_entry {
+  struct memo_entry *next;
+  struct memo_entry *lru_prev;
+  struct memo_entry *lru_next;
+  unsigned long hash;
+  size_t key_len;
+  size_t value_len;
+  unsigned char data[];
+};
+
+struct memo {
+  size_t capacity;
+  size_t size;
+  size_t count;
+  uint64_t hits;
+  uint64_t misses;
+  struct memo_entry **buckets;
+  struct memo_entry *head;
+  struct memo_entry *tail;
+};
+
+static void
+memo_unlink(struct memo *c, struct memo_entry *e)
+{
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  }
+  else {
+    c->head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  }
+  else {
+    c->tail = e->lru_prev;
+  }
+}
+
+static void
+memo_push(struct memo *c, struct memo_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = c->head;
+  if (c->head != NULL) {
+    c->head->lru_prev = e;
+  }
+  else {
+    c->tail = e;
+  }
+  c->head = e;
+}
+
+static void
+memo_remove(struct memo *c, struct memo_entry *e)
+{
+  struct memo_entry **p = &c->buckets[e->hash & (c->size - 1)];
+  while (*p != e) {
+    p = &(*p)->next;
+  }
+  *p = e->next;
+  memo_unlink(c, e);
+  free(e);
+  c->count--;
+}
+
+static void
+memo_clear(struct memo *c)
+{
+  while (c->head != NULL) {
+    memo_remove(c, c->head);
+  }
+}
+
+static void
+free_memo(struct memo *c)
+{
+  if (c != NULL) {
+    memo_clear(c);
+    free(c->buckets);
+    free(c);
+  }
+}
+
+/**
+ * Encode arguments starting at index base as cache key in arena memory.
+ * Returns NULL if the arguments can't be cached.
+ */
+static unsigned char *
+memo_key(lua_State *L, const struct signature *sig, int base, size_t *len)
+{
+  if (lua_gettop(L) - base + 1 > sig->nargs) {
+    return NULL;
+  }
+  for (int i = 0; i < sig->nargs; i++) {
+    int t = lua_type(L, base + i);
+    if (t != LUA_TNONE && t != LUA_TNIL && t != LUA_TBOOLEAN && t != LUA_TNUMBER && t != LUA_TSTRING) {
+      return NULL;
+    }
+  }
+  lua_settop(L, base + sig->nargs - 1);
+  struct encoder e = {NULL, 0};
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      e.out = arena_alloc(L, e.n);
+      e.n = 0;
+    }
+    for (int i = 0; i < sig->nargs; i++) {
+      encode_value(L, base + i, 0, 0, &e);
+    }
+  }
+  *len = e.n;
+  return e.out;
+}
+
+static struct memo_entry *
+memo_find(struct memo *c, const unsigned char *key, size_t len, unsigned long hash)
+{
+  struct memo_entry *e = c->buckets[hash & (c->size - 1)];
+  while (e != NULL && (e->hash != hash || e->key_len != len || memcmp(e->data, key, len) != 0)) {
+    e = e->next;
+  }
+  return e;
+}
+
+/**
+ * Store nret results of call on top of Lua stack in cache under given
+ * key, unless they can't be encoded.
+ */
+static void
+memo_store(lua_State *L, struct memo *c, const unsigned char *key, size_t key_len, unsigned long hash,
+           int nret)
+{
+  int t = nret > 0 ? lua_type(L, -1) : LUA_TNIL;
+  if (t != LUA_TNIL && t != LUA_TBOOLEAN && t != LUA_TNUMBER && t != LUA_TSTRING && t != LUA_TTABLE) {
+    return;
+  }
+  struct encoder e = {NULL, 0};
+  if (nret == 0) {
+    e.n = 1;
+  }
+  else {
+    encode_value(L, -1, 0, 0, &e);
+  }
+  struct memo_entry *entry = malloc(sizeof(*entry) + key_len + e.n);
+  if (entry == NULL) {
+    return;
+  }
+  memcpy(entry->data, key, key_len);
+  e.out = entry->data + key_len;
+  e.n = 0;
+  if (nret == 0) {
+    enc_u8(&e, 'V');
+  }
+  else {
+    encode_value(L, -1, 0, 0, &e);
+  }
+  entry->hash = hash;
+  entry->key_len = key_len;
+  entry->value_len = e.n;
+  struct memo_entry **bucket = &c->buckets[hash & (c->size - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  memo_push(c, entry);
+  if (++c->count > c->capacity) {
+    memo_remove(c, c->tail);
+  }
+}
+
+/**
+ * Cache key of call missing in result cache, kept by memo_lookup() for
+ * memo_update().  Cache c is NULL if the call can't be cached.
+ */
+struct memo_probe {
+  struct memo *c;
+  unsigned char *key;
+  size_t key_len;
+  unsigned long hash;
+};
+
+/**
+ * Look up call of method handle with arguments starting at index base
+ * in its result cache, if it has one.
+ * Returns number of cached values pushed on hit, or -1 on miss, with
+ * probe set up for memo_update().
+ */
+static int
+memo_lookup(lua_State *L, struct method *h, int base, struct memo_probe *probe)
+{
+  struct memo *c = h->memo;
+  probe->c = NULL;
+  if (c == NULL) {
+    return -1;
+  }
+  probe->key = memo_key(L, &h->sig, base, &probe->key_len);
+  if (probe->key == NULL) {
+    return -1;
+  }
+  probe->hash = hash_key((const char *)probe->key, probe->key_len);
+  struct memo_entry *e = memo_find(c, probe->key, probe->key_len, probe->hash);
+  if (e != NULL) {
+    c->hits++;
+    memo_unlink(c, e);
+    memo_push(c, e);
+    const unsigned char *p = e->data + e->key_len;
+    return push_value(L, &p, p + e->value_len, 0);
+  }
+  c->misses++;
+  probe->c = c;
+  return -1;
+}
+
+/**
+ * Store nret results of call missed by memo_lookup() in result cache.
+ */
+static void
+memo_update(lua_State *L, struct method *h, const struct memo_probe *probe, int nret)
+{
+  struct memo *c = probe->c;
+  /* The call may have changed cache through a callback. */
+  if (c != NULL && h->memo == c && memo_find(c, probe->key, probe->key_len, probe->hash) == NULL) {
+    memo_store(L, c, probe->key, probe->key_len, probe->hash, nret);
+  }
+}
+
+/**
+ * Call method handle with arguments starting at index base, serving
+ * the call from its result cache if it has one.
+ */
+static int
+memo_call(lua_State *L, struct method *h, int base)
+{
+  struct memo_probe probe;
+  int nret = memo_lookup(L, h, base, &probe);
+  if (nret < 0) {
+    nret = invoke(L, h, NULL, base);
+    memo_update(L, h, &probe, nret);
+  }
+  return nret;
+}
+
+/**
+ * Create prepared method handle.
+ *
+ * Resolve static method and parse its signature once, returning
+ * callable userdata that invokes the method with given arguments,
+ * eg. local getprop = lujavrite.method("java/lang/System", "getProperty",
+ * "(Ljava/lang/String;)Ljava/lang/String;"); getprop("java.version")
+ *
+ * Parameters:
+ * - class name, eg. "com/mycompany/MyClass"
+ * - method name, eg. "myMethod"
+ * - method signature, eg. "(Ljava/lang/String;)Ljava/lang/String;"
+ *
+ * Returns:
+ * - method handle
+ */
+static int
+method(lua_State *L)
+{
+  attach_thread(L);
+  const char *class_name = luaL_checkstring(L, 1);
+  const char *method_name = luaL_checkstring(L, 2);
+  const char *method_signature = luaL_checkstring(L, 3);
+
+  struct method *m = resolve_method(L, METHOD_STATIC, class_name, NULL, NULL, method_name, method_signature);
+  struct method *h = lua_newuserdatauv(L, sizeof(*h), 0);
+  copy_method(h, m);
+  unpin_method(m);
+  luaL_setmetatable(L, "lujavrite.method");
+  return 1;
+}
+
+static int
+method_call(lua_State *L)
+{
+  struct method *h = luaL_checkudata(L, 1, "lujavrite.method");
+  attach_thread(L);
+  arena_reset();
+  return memo_call(L, h, 2);
+}
+
+static int
+method_gc(lua_State *L)
+{
+  struct method *h = luaL_checkudata(L, 1, "lujavrite.method");
+  free_memo(h->memo);
+  h->memo = NULL;
+  if (h->cls != NULL && attach_for_gc()) {
+    release_method(h);
+  }
+  return 0;
+}
+
+/**
+ * Cache results of method handle, eg. getprop:memoize(100).
+ *
+ * The method must be pure: calls with the same arguments as one of the
+ * cached calls return its result without calling Java.  At most given
+ * number of results are kept, evicting the least recently used ones.
+ * Calls with object handle or table arguments are never cached, nor
+ * are object handles returned.  Exceptions are not cached either.
+ *
+ * Parameters:
+ * - method handle
+ * - maximum number of cached results, or 0 to stop caching
+ *
+ * Returns:
+ * - method handle
+ */
+static int
+method_memoize(lua_State *L)
+{
+  struct method *h = luaL_checkudata(L, 1, "lujavrite.method");
+  lua_Integer capacity = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, capacity >= 0 && capacity <= 1 << 20, 2, "capacity out of range");
+  free_memo(h->memo);
+  h->memo = NULL;
+  if (capacity > 0) {
+    size_t size = 1;
+    while (size < (size_t)capacity) {
+      size <<= 1;
+    }
+    struct memo *c = calloc(1, sizeof(*c));
+    if (c == NULL || (c->buckets = calloc(size, sizeof(*c->buckets))) == NULL) {
+      free(c);
+      return luaL_error(L, "out of memory");
+    }
+    c->capacity = (size_t)capacity;
+    c->size = size;
+    h->memo = c;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+/**
+ * Drop all cached results of method handle, keeping its counters.
+ */
+static int
+method_invalidate(lua_State *L)
+{
+  struct method *h = luaL_checkudata(L, 1, "lujavrite.method");
+  if (h->memo != NULL) {
+    memo_clear(h->memo);
+  }
+  return 0;
+}
+
+/**
+ * Get result cache counters of method handle.
+ *
+ * Returns:
+ * - table with hits, misses, size and capacity fields, or nil if the
+ *   handle is not memoized
+ */
+static int
+method_memo_stats(lua_State *L)
+{
+  struct method *h = luaL_checkudata(L, 1, "lujavrite.method");
+  struct memo *c = h->memo;
+  if (c == NULL) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 4);
+  set_count_field(L, "hits", c->hits);
+  set_count_field(L, "misses", c->misses);
+  set_count_field(L, "size", c->count);
+  set_count_field(L, "capacity", c->capacity);
+  return 1;
+}
+
+/**
+ * Push arguments of k-th tuple of batch at index batch.
+ */
+static void
+push_tuple(lua_State *L, int batch, lua_Integer k)
+{
+  lua_rawgeti(L, batch, k);
+  if (!lua_istable(L, -1)) {
+    return;
+  }
+  int tuple = lua_gettop(L);
+  size_t n = lua_rawlen(L, tuple);
+  luaL_checkstack(L, n < INT_MAX ? (int)n : INT_MAX, "too many arguments");
+  for (size_t i = 1; i <= n; i++) {
+    lua_rawgeti(L, tuple, (lua_Integer)i);
+  }
+  lua_remove(L, tuple);
+}
+
+static int
+object_gc(lua_State *L)
+{
+  struct object *h = luaL_checkudata(L, 1, "lujavrite.object");
+  if (h->callback != 0) {
+    lua_getfield(L, LUA_REGISTRYINDEX, "lujavrite.callbacks");
+    if (lua_istable(L, -1)) {
+      lua_pushnil(L);
+      lua_rawseti(L, -2, h->callback);
+    }
+    lua_pop(L, 1);
+    h->callback = 0;
+  }
+  if ((h->ref != NULL || h->cls != NULL) && attach_for_gc()) {
+    if (h->ref != NULL) {
+      (*J)->DeleteGlobalRef(J, h->ref);
+    }
+    if (h->cls != NULL) {
+      (*J)->DeleteGlobalRef(J, h->cls);
+    }
+  }
+  h->ref = NULL;
+  h->cls = NULL;
+  return 0;
+}
+
+/**
+ * Convert object handle to string with Object.toString().
+ */
+static int
+object_tostring(lua_State *L)
+{
+  struct object *h = luaL_checkudata(L, 1, "lujavrite.object");
+  attach_thread(L);
+  if ((*J)->PushLocalFrame(J, 1) != 0) {
+    raise_exception(L);
+  }
+  jvalue str;
+  str.l = (*J)->CallObjectMethodA(J, h->ref, object_to_string, NULL);
+  if ((*J)->ExceptionCheck(J)) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  if (str.l == NULL) {
+    (*J)->PopLocalFrame(J, NULL);
+    lua_pushliteral(L, "null");
+    return 1;
+  }
+  push_result_in_frame(L, 'T', str);
+  (*J)->PopLocalFrame(J, NULL);
+  return 1;
+}
+
+/**
+ * Compare object handles for identity of the objects they refer to.
+ */
+static int
+object_eq(lua_State *L)
+{
+  struct object *a = luaL_checkudata(L, 1, "lujavrite.object");
+  struct object *b = luaL_checkudata(L, 2, "lujavrite.object");
+  attach_thread(L);
+  lua_pushboolean(L, (*J)->IsSameObject(J, a->ref, b->ref));
+  return 1;
+}
+
+/**
+ * Call instance method of object, eg. list:call("size", "()I").
+ *
+ * Parameters:
+ * - object handle
+ * - method name, eg. "myMethod"
+ * - method signature, eg. "(Ljava/lang/String;)Ljava/lang/String;"
+ * - zero or more arguments
+ *
+ * Arguments and return value are converted like in call().  Methods are
+ * looked up in class of the object and cached per class.
+ *
+ * Returns:
+ * - return value of Java method, if any
+ */
+static int
+object_call(lua_State *L)
+{
+  struct object *h = luaL_checkudata(L, 1, "lujavrite.object");
+  attach_thread(L);
+  arena_reset();
+  const char *method_name = luaL_checkstring(L, 2);
+  const char *method_signature = luaL_checkstring(L, 3);
+  if (h->cls == NULL) {
+    jclass cls = (*J)->GetObjectClass(J, h->ref);
+    h->cls = (*J)->NewGlobalRef(J, cls);
+    (*J)->DeleteLocalRef(J, cls);
+  }
+
+  struct method *m = resolve_method(L, METHOD_INSTANCE, NULL, h->cls, NULL, method_name, method_signature);
+  int nret = invoke(L, m, h->ref, 4);
+  unpin_method(m);
+  return nret;
+}
+
+/**
+ * Convert collection, map or array to Lua table, eg. list:totable().
+ * Nested collections are converted too, while values which are not
+ * collections, strings, numbers or booleans are not supported.
+ *
+ * Parameters:
+ * - object handle
+ *
+ * Returns:
+ * - table with elements of collection or array, or keys and values of map
+ */
+static int
+object_totable(lua_State *L)
+{
+  struct object *h = luaL_checkudata(L, 1, "lujavrite.object");
+  attach_thread(L);
+  arena_reset();
+  init_bulk(L);
+  if ((*J)->PushLocalFrame(J, 2) != 0) {
+    raise_exception(L);
+  }
+  jvalue obj;
+  obj.l = h->ref;
+  push_result_in_frame(L, 's', obj);
+  (*J)->PopLocalFrame(J, NULL);
+  return 1;
+}
+
+/**
+ * Iterator over Java elements, pulled in chunks by stream_next().
+ * The iterator reference is released once it is exhausted.
+ */
+struct stream {
+  jobject iterator;
+  int batch;
+};
+
+static int
+stream_gc(lua_State *L)
+{
+  struct stream *s = luaL_checkudata(L, 1, "lujavrite.stream");
+  if (s->iterator != NULL && attach_for_gc()) {
+    (*J)->DeleteGlobalRef(J, s->iterator);
+    s->iterator = NULL;
+  }
+  return 0;
+}
+
+/**
+ * Convert chunk packed by Bulk.next(), passed as light userdata.
+ */
+static int
+convert_chunk(lua_State *L)
+{
+  if (push_packed(L, lua_touserdata(L, 1)) != 0) {
+    return raise_exception(L);
+  }
+  return 1;
+}
+
+/**
+ * Get next chunk of stream, or nothing at its end.
+ */
+static int
+stream_next(lua_State *L)
+{
+  struct stream *s = luaL_checkudata(L, lua_upvalueindex(1), "lujavrite.stream");
+  if (s->iterator == NULL) {
+    return 0;
+  }
+  attach_thread(L);
+  arena_reset();
+  if ((*J)->PushLocalFrame(J, 2) != 0) {
+    raise_exception(L);
+  }
+  jvalue args[2];
+  args[0].l = s->iterator;
+  args[1].i = s->batch;
+  jbyteArray arr = (*J)->CallStaticObjectMethodA(J, bulk_class, bulk_next, args);
+  if ((*J)->ExceptionCheck(J)) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  if (arr == NULL) {
+    (*J)->DeleteGlobalRef(J, s->iterator);
+    s->iterator = NULL;
+    (*J)->PopLocalFrame(J, NULL);
+    return 0;
+  }
+  lua_pushlightuserdata(L, arr);
+  run_in_frame(L, convert_chunk, 1);
+  (*J)->PopLocalFrame(J, NULL);
+  return 1;
+}
+
+/**
+ * Iterate over elements of Java Iterator, Iterable or Stream in chunks,
+ * eg. for chunk in lujavrite.stream(lines, 1000) do ... end
+ *
+ * Each step pulls up to batch elements with a single call to Java and
+ * returns them as a table, so that elements are converted as they are
+ * produced and only one chunk is held in memory at a time.  Elements
+ * are converted like by obj:totable().  Streams are closed when
+ * exhausted.
+ *
+ * Parameters:
+ * - handle of Iterator, Iterable or Stream
+ * - maximum number of elements per chunk (default 256)
+ *
+ * Returns:
+ * - iterator function returning successive chunks
+ */
+static int
+stream(lua_State *L)
+{
+  struct object *h = luaL_checkudata(L, 1, "lujavrite.object");
+  lua_Integer batch = luaL_optinteger(L, 2, 256);
+  luaL_argcheck(L, batch > 0 && batch <= 1 << 20, 2, "batch size out of range");
+  attach_thread(L);
+  arena_reset();
+  init_bulk(L);
+  struct stream *s = lua_newuserdatauv(L, sizeof(*s), 0);
+  s->iterator = NULL;
+  s->batch = (int)batch;
+  luaL_setmetatable(L, "lujavrite.stream");
+
+  if ((*J)->PushLocalFrame(J, 1) != 0) {
+    raise_exception(L);
+  }
+  jvalue arg;
+  arg.l = h->ref;
+  jobject it = (*J)->CallStaticObjectMethodA(J, bulk_class, bulk_iterator, &arg);
+  if (it == NULL) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  s->iterator = (*J)->NewGlobalRef(J, it);
+  (*J)->PopLocalFrame(J, NULL);
+  lua_pushcclosure(L, stream_next, 1);
+  return 1;
+}
+
+/**
+ * Layout of channel buffer shared with io.kojan.lujavrite.Channel,
+ * see its documentation.  Each control word is on its own cache line,
+ * so that producer and consumer don't invalidate each other's lines
+ * more than they have to.
+ */
+#define CHANNEL_HEAD 0
+#define CHANNEL_TAIL 64
+#define CHANNEL_LUA_WAITING 128
+#define CHANNEL_LUA_WAKE 132
+#define CHANNEL_JAVA_WAITING 192
+#define CHANNEL_CLOSED 256
+#define CHANNEL_DATA 320
+
+static jclass channel_class;
+static jmethodID channel_init;
+static jmethodID channel_buffer;
+static jmethodID channel_wake;
+static int channels_ready;
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Lua end of a channel.  The ring lives in direct buffer owned by the
+ * Java object, which the global reference keeps alive.
+ */
+struct channel {
+  jobject ref;
+  unsigned char *mem;
+  uint64_t capacity;
+};
+
+#define CHANNEL_WORD(c, type, off) ((type *)((c)->mem + (off)))
+
+/**
+ * Wake up Lua side waiting in channel_wait(), called by Java after
+ * changing the ring while Lua waiting flag was set.
+ */
+static void JNICALL
+channel_wake_native(JNIEnv *env, jclass cls, jobject buf)
+{
+  (void)cls;
+  unsigned char *mem = (*env)->GetDirectBufferAddress(env, buf);
+  if (mem != NULL) {
+    syscall(SYS_futex, (uint32_t *)(mem + CHANNEL_LUA_WAKE), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/**
+ * Register native method of io.kojan.lujavrite.Channel on first use,
+ * raising Lua error if it is not available.
+ */
+static void
+init_channels(lua_State *L)
+{
+  static const JNINativeMethod natives[] = {
+    {"wakeNative", "(Ljava/nio/ByteBuffer;)V", (void *)channel_wake_native},
+  };
+  pthread_mutex_lock(&channels_lock);
+  int ok = channels_ready;
+  if (!ok) {
+    jclass cls = (*J)->FindClass(J, "io/kojan/lujavrite/Channel");
+    ok = cls != NULL
+      && (*J)->RegisterNatives(J, cls, natives, 1) == 0
+      && (channel_init = (*J)->GetMethodID(J, cls, "<init>", "(I)V")) != NULL
+      && (channel_buffer = (*J)->GetMethodID(J, cls, "buffer", "()Ljava/nio/ByteBuffer;")) != NULL
+      && (channel_wake = (*J)->GetMethodID(J, cls, "wake", "()V")) != NULL;
+    if (ok) {
+      channel_class = (*J)->NewGlobalRef(J, cls);
+      channels_ready = 1;
+    }
+    (*J)->DeleteLocalRef(J, cls);
+  }
+  pthread_mutex_unlock(&channels_lock);
+  if (!ok) {
+    raise_exception(L);
+  }
+}
+
+static struct channel *
+check_channel(lua_State *L)
+{
+  struct channel *c = luaL_checkudata(L, 1, "lujavrite.channel");
+  luaL_argcheck(L, c->ref != NULL, 1, "channel is released");
+  return c;
+}
+
+static uint64_t
+channel_used(struct channel *c)
+{
+  return __atomic_load_n(CHANNEL_WORD(c, uint64_t, CHANNEL_TAIL), __ATOMIC_SEQ_CST)
+    - __atomic_load_n(CHANNEL_WORD(c, uint64_t, CHANNEL_HEAD), __ATOMIC_SEQ_CST);
+}
+
+static int
+channel_closed(struct channel *c)
+{
+  return __atomic_load_n(CHANNEL_WORD(c, uint32_t, CHANNEL_CLOSED), __ATOMIC_SEQ_CST) != 0;
+}
+
+/**
+ * Bytes taken in the ring by record of given length.
+ */
+static uint64_t
+channel_record_size(size_t len)
+{
+  return 4 + (((uint64_t)len + 3) & ~(uint64_t)3);
+}
+
+/**
+ * Called after changing the ring.  Wakes up Java side if it is
+ * waiting, which is the only time Lua side calls Java.
+ */
+static void
+channel_notify(lua_State *L, struct channel *c)
+{
+  if (__atomic_load_n(CHANNEL_WORD(c, uint32_t, CHANNEL_JAVA_WAITING), __ATOMIC_SEQ_CST) != 0) {
+    (*J)->CallVoidMethodA(J, c->ref, channel_wake, NULL);
+    if ((*J)->ExceptionCheck(J)) {
+      raise_exception(L);
+    }
+  }
+}
+
+/**
+ * Wait until Java side changes the ring, or until deadline passes.
+ * Lua waiting flag is set before need is checked once more, so any
+ * change made after the check is followed by a wakeup.  need is the
+ * number of free bytes to wait for, or 0 to wait for a record.
+ * Returns 0 if deadline passed, 1 otherwise.
+ */
+static int
+channel_wait(struct channel *c, uint64_t need, const struct timespec *deadline)
+{
+  uint32_t *wake = CHANNEL_WORD(c, uint32_t, CHANNEL_LUA_WAKE);
+  uint32_t *waiting = CHANNEL_WORD(c, uint32_t, CHANNEL_LUA_WAITING);
+  uint32_t seq = __atomic_load_n(wake, __ATOMIC_SEQ_CST);
+  int ok = 1;
+  __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+  uint64_t used = channel_used(c);
+  if (!channel_closed(c) && (need == 0 ? used == 0 : c->capacity - used < need)) {
+    struct timespec timeout, *t = NULL;
+    if (deadline != NULL) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long long nsec = (deadline->tv_sec - now.tv_sec) * 1000000000LL + deadline->tv_nsec - now.tv_nsec;
+      timeout.tv_sec = nsec / 1000000000;
+      timeout.tv_nsec = nsec % 1000000000;
+      t = &timeout;
+      ok = nsec > 0;
+    }
+    if (ok) {
+      syscall(SYS_futex, wake, FUTEX_WAIT_PRIVATE, seq, t, NULL, 0);
+    }
+  }
+  __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+  return ok;
+}
+
+/**
+ * Get deadline for optional timeout in seconds at given stack index.
+ * Returns NULL if there is no timeout.
+ */
+static struct timespec *
+channel_deadline(lua_State *L, int idx, struct timespec *deadline)
+{
+  if (lua_isnoneornil(L, idx)) {
+    return NULL;
+  }
+  lua_Number timeout = luaL_checknumber(L, idx);
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  if (timeout > 0) {
+    long long nsec = deadline->tv_nsec + (long long)(timeout * 1e9);
+    deadline->tv_sec += nsec / 1000000000;
+    deadline->tv_nsec = nsec % 1000000000;
+  }
+  return deadline;
+}
+
+/**
+ * Append record to channel, eg. ch:push("record").
+ *
+ * Parameters:
+ * - record string
+ * - optional timeout in seconds; without it push waits for space as
+ *   long as needed, with 0 it doesn't wait at all
+ *
+ * Returns:
+ * - true if the record was added, false if the ring stayed full
+ */
+static int
+channel_push(lua_State *L)
+{
+  struct channel *c = check_channel(L);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  uint64_t need = channel_record_size(len);
+  luaL_argcheck(L, need <= c->capacity, 2, "record too large for channel");
+  struct timespec deadline_buf, *deadline = channel_deadline(L, 3, &deadline_buf);
+  attach_thread(L);
+  for (;;) {
+    if (channel_closed(c)) {
+      return luaL_error(L, "channel is closed");
+    }
+    if (c->capacity - channel_used(c) >= need) {
+      break;
+    }
+    if (!channel_wait(c, need, deadline)) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+
+  uint64_t *tail = CHANNEL_WORD(c, uint64_t, CHANNEL_TAIL);
+  uint64_t pos = *tail & (c->capacity - 1);
+  uint32_t n = (uint32_t)len;
+  memcpy(c->mem + CHANNEL_DATA + pos, &n, 4);
+  pos = (pos + 4) & (c->capacity - 1);
+  size_t first = len < c->capacity - pos ? len : c->capacity - pos;
+  memcpy(c->mem + CHANNEL_DATA + pos, s, first);
+  memcpy(c->mem + CHANNEL_DATA, s + first, len - first);
+  __atomic_store_n(tail, *tail + need, __ATOMIC_SEQ_CST);
+  channel_notify(L, c);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/**
+ * Remove next record from channel, eg. local record = ch:pop().
+ *
+ * Parameters:
+ * - optional timeout in seconds; without it pop waits for a record as
+ *   long as needed, with 0 it doesn't wait at all
+ *
+ * Returns:
+ * - record string, or nil if the ring stayed empty or the channel is
+ *   closed and all records have been taken
+ */
+static int
+channel_pop(lua_State *L)
+{
+  struct channel *c = check_channel(L);
+  struct timespec deadline_buf, *deadline = channel_deadline(L, 2, &deadline_buf);
+  attach_thread(L);
+  arena_reset();
+  while (channel_used(c) == 0) {
+    if (channel_closed(c) ? channel_used(c) == 0 : !channel_wait(c, 0, deadline)) {
+      lua_pushnil(L);
+      return 1;
+    }
+  }
+
+  uint64_t *head = CHANNEL_WORD(c, uint64_t, CHANNEL_HEAD);
+  uint64_t pos = *head & (c->capacity - 1);
+  uint32_t len;
+  memcpy(&len, c->mem + CHANNEL_DATA + pos, 4);
+  pos = (pos + 4) & (c->capacity - 1);
+  size_t first = len < c->capacity - pos ? len : c->capacity - pos;
+  if (first == len) {
+    lua_pushlstring(L, (const char *)c->mem + CHANNEL_DATA + pos, len);
+  }
+  else {
+    char *p = arena_alloc(L, len);
+    memcpy(p, c->mem + CHANNEL_DATA + pos, first);
+    memcpy(p + first, c->mem + CHANNEL_DATA, len - first);
+    lua_pushlstring(L, p, len);
+  }
+  __atomic_store_n(head, *head + channel_record_size(len), __ATOMIC_SEQ_CST);
+  channel_notify(L, c);
+  return 1;
+}
+
+/**
+ * Close channel.  Records already in the ring can still be taken, but
+ * no more can be added.
+ */
+static int
+channel_close(lua_State *L)
+{
+  struct channel *c = check_channel(L);
+  attach_thread(L);
+  __atomic_store_n(CHANNEL_WORD(c, uint32_t, CHANNEL_CLOSED), 1, __ATOMIC_SEQ_CST);
+  channel_notify(L, c);
+  return 0;
+}
+
+/**
+ * Get handle of io.kojan.lujavrite.Channel object for Java side of
+ * channel, eg. to pass it to Java thread consuming records.
+ */
+static int
+channel_java(lua_State *L)
+{
+  struct channel *c = check_channel(L);
+  attach_thread(L);
+  push_object(L, c->ref);
+  return 1;
+}
+
+static int
+channel_gc(lua_State *L)
+{
+  struct channel *c = luaL_checkudata(L, 1, "lujavrite.channel");
+  if (c->ref != NULL && attach_for_gc()) {
+    (*J)->DeleteGlobalRef(J, c->ref);
+    c->ref = NULL;
+  }
+  return 0;
+}
+
+/**
+ * Create channel passing records between Lua and a Java thread, eg.
+ * local ch = lujavrite.channel(1 << 20).
+ *
+ * The channel is a single-producer single-consumer ring buffer in
+ * direct memory, visible to Java through io.kojan.lujavrite.Channel
+ * returned by ch:java().  Records are strings on Lua side and byte
+ * arrays on Java side.  Either side can be the producer, but there
+ * must be only one Lua state and one Java thread using the channel.
+ * Records are copied into and out of the ring without calling Java;
+ * Java is called only to wake up Java side waiting for data or space.
+ *
+ * Parameters:
+ * - ring capacity in bytes, rounded up to power of two (default 65536);
+ *   each record takes its length rounded up to multiple of 4, plus 4
+ *
+ * Returns:
+ * - channel with push(), pop(), close() and java() methods
+ */
+static int
+channel(lua_State *L)
+{
+  lua_Integer size = luaL_optinteger(L, 1, 65536);
+  luaL_argcheck(L, size > 0 && size <= 1 << 30, 1, "capacity out of range");
+  uint64_t capacity = 64;
+  while (capacity < (uint64_t)size) {
+    capacity <<= 1;
+  }
+  attach_thread(L);
+  arena_reset();
+  init_channels(L);
+  struct channel *c = lua_newuserdatauv(L, sizeof(*c), 0);
+  c->ref = NULL;
+  c->mem = NULL;
+  c->capacity = capacity;
+  luaL_setmetatable(L, "lujavrite.channel");
+
+  if ((*J)->PushLocalFrame(J, 2) != 0) {
+    raise_exception(L);
+  }
+  jvalue arg;
+  arg.i = (jint)capacity;
+  jobject obj = (*J)->NewObjectA(J, channel_class, channel_init, &arg);
+  jobject buf = obj != NULL ? (*J)->CallObjectMethodA(J, obj, channel_buffer, NULL) : NULL;
+  if (buf == NULL) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  c->mem = (*J)->GetDirectBufferAddress(J, buf);
+  if (c->mem == NULL) {
+    return pop_frame_and_raise(L, "direct buffer access is not supported by JVM");
+  }
+  c->ref = (*J)->NewGlobalRef(J, obj);
+  (*J)->PopLocalFrame(J, NULL);
+  return 1;
+}
+
+static lua_Integer next_loader_id;
+static pthread_mutex_t loaders_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Drop method resolution cache entries of given class loader, so that
+ * the loader and its classes can be unloaded.
+ */
+static void
+release_loader_methods(lua_Integer id)
+{
+  pthread_mutex_lock(&method_cache_lock);
+  for (size_t i = 0; i < method_cache_size; i++) {
+    struct cache_entry **p = &method_cache[i];
+    while (*p != NULL) {
+      struct cache_entry *e = *p;
+      if (e->loader == id) {
+        *p = e->next;
+        release_entry(e);
+        method_cache_count--;
+      }
+      else {
+        p = &e->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&method_cache_lock);
+}
+
+static int
+loader_gc(lua_State *L)
+{
+  struct loader *l = luaL_checkudata(L, 1, "lujavrite.loader");
+  if (l->ref != NULL && attach_for_gc()) {
+    release_loader_methods(l->id);
+    (*J)->DeleteGlobalRef(J, l->ref);
+  }
+  l->ref = NULL;
+  return 0;
+}
+
+static struct loader *
+check_loader(lua_State *L)
+{
+  struct loader *l = luaL_checkudata(L, 1, "lujavrite.loader");
+  luaL_argcheck(L, l->ref != NULL, 1, "class loader is released");
+  return l;
+}
+
+/**
+ * Call static Java function of class loaded by class loader, eg.
+ * plugins:call("com/mycompany/Plugin", "run", "()V").
+ *
+ * Same as call(), but the class is loaded with loadClass() of the
+ * class loader, and resolved methods are cached per loader.
+ */
+static int
+loader_call(lua_State *L)
+{
+  struct loader *l = check_loader(L);
+  attach_thread(L);
+  arena_reset();
+  const char *class_name = luaL_checkstring(L, 2);
+  const char *method_name = luaL_checkstring(L, 3);
+  const char *method_signature = luaL_checkstring(L, 4);
+
+  struct method *m = resolve_method(L, METHOD_STATIC, class_name, NULL, l, method_name, method_signature);
+  int nret = invoke(L, m, NULL, 5);
+  unpin_method(m);
+  return nret;
+}
+
+/**
+ * Create Java object of class loaded by class loader, eg.
+ * plugins:new("com/mycompany/Plugin", "()V").
+ *
+ * Same as new(), but the class is loaded with loadClass() of the class
+ * loader.
+ */
+static int
+loader_new(lua_State *L)
+{
+  struct loader *l = check_loader(L);
+  attach_thread(L);
+  arena_reset();
+  const char *class_name = luaL_checkstring(L, 2);
+  const char *constructor_signature = luaL_checkstring(L, 3);
+
+  struct method *m = resolve_method(L, METHOD_CONSTRUCTOR, class_name, NULL, l, "<init>", constructor_signature);
+  int nret = invoke(L, m, NULL, 4);
+  unpin_method(m);
+  return nret;
+}
+
+/**
+ * Create prepared method handle for static method of class loaded by
+ * class loader, eg. plugins:method("com/mycompany/Plugin", "run", "()V").
+ *
+ * Same as method(), but the class is loaded with loadClass() of the
+ * class loader.  The handle keeps the class, and so the loader, alive.
+ */
+static int
+loader_method(lua_State *L)
+{
+  struct loader *l = check_loader(L);
+  attach_thread(L);
+  const char *class_name = luaL_checkstring(L, 2);
+  const char *method_name = luaL_checkstring(L, 3);
+  const char *method_signature = luaL_checkstring(L, 4);
+
+  struct method *m = resolve_method(L, METHOD_STATIC, class_name, NULL, l, method_name, method_signature);
+  struct method *h = lua_newuserdatauv(L, sizeof(*h), 0);
+  copy_method(h, m);
+  unpin_method(m);
+  luaL_setmetatable(L, "lujavrite.method");
+  return 1;
+}
+
+/**
+ * Create class loader loading classes from given JAR files or class
+ * directories, eg. local plugins = lujavrite.loader({"plugin.jar"}).
+ *
+ * The loader is java.net.URLClassLoader delegating to the system class
+ * loader, so that sets of classes loaded by different loaders are
+ * isolated from each other while sharing one JVM.  Classes are reached
+ * with loader:call(), loader:new() and loader:method(), which work like
+ * call(), new() and method().  Loaders are cached by their paths: as
+ * long as a loader is referenced, the same paths give the same loader.
+ *
+ * Parameters:
+ * - sequence of paths of JAR files or directories
+ *
+ * Returns:
+ * - class loader handle; when it is garbage collected, cached methods
+ *   of the loader are dropped so that its classes can be unloaded
+ */
+static int
+new_loader(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_Integer n = luaL_len(L, 1);
+  luaL_argcheck(L, n > 0 && n <= INT_MAX, 1, "no paths given");
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (lua_Integer i = 1; i <= n; i++) {
+    if (lua_geti(L, 1, i) != LUA_TSTRING) {
+      return luaL_argerror(L, 1, "paths must be strings");
+    }
+    luaL_addvalue(&b);
+    luaL_addchar(&b, '\0');
+  }
+  luaL_pushresult(&b);
+  size_t key_len;
+  const char *key = lua_tolstring(L, -1, &key_len);
+
+  if (!luaL_getsubtable(L, LUA_REGISTRYINDEX, "lujavrite.loaders")) {
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+  }
+  lua_pushvalue(L, -2);
+  if (lua_rawget(L, -2) == LUA_TUSERDATA) {
+    return 1;
+  }
+  lua_pop(L, 1);
+
+  attach_thread(L);
+  arena_reset();
+  struct loader *l = lua_newuserdatauv(L, sizeof(*l), 0);
+  l->ref = NULL;
+  pthread_mutex_lock(&loaders_lock);
+  l->id = ++next_loader_id;
+  pthread_mutex_unlock(&loaders_lock);
+  luaL_setmetatable(L, "lujavrite.loader");
+
+  if ((*J)->PushLocalFrame(J, 5) != 0) {
+    raise_exception(L);
+  }
+  jobjectArray urls = (*J)->NewObjectArray(J, (jsize)n, url_class, NULL);
+  if (urls == NULL) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  const char *path = key;
+  for (jsize i = 0; i < (jsize)n; i++) {
+    jvalue arg;
+    size_t path_len = strlen(path);
+    arg.l = new_string(path, path_len);
+    jobject file = arg.l != NULL ? (*J)->NewObjectA(J, file_class, file_init, &arg) : NULL;
+    jobject uri = file != NULL ? (*J)->CallObjectMethodA(J, file, file_to_uri, NULL) : NULL;
+    jobject url = uri != NULL ? (*J)->CallObjectMethodA(J, uri, uri_to_url, NULL) : NULL;
+    if (url == NULL) {
+      return pop_frame_and_raise(L, NULL);
+    }
+    (*J)->SetObjectArrayElement(J, urls, i, url);
+    (*J)->DeleteLocalRef(J, url);
+    (*J)->DeleteLocalRef(J, uri);
+    (*J)->DeleteLocalRef(J, file);
+    (*J)->DeleteLocalRef(J, arg.l);
+    path += path_len + 1;
+  }
+  jvalue arg;
+  arg.l = urls;
+  jobject cl = (*J)->NewObjectA(J, url_class_loader_class, url_class_loader_init, &arg);
+  if (cl == NULL) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  l->ref = (*J)->NewGlobalRef(J, cl);
+  (*J)->PopLocalFrame(J, NULL);
+
+  lua_pushvalue(L, -3);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  return 1;
+}
+
+/**
+ * Create Java object, eg. lujavrite.new("java/util/ArrayList", "(I)V", 10).
+ *
+ * Parameters:
+ * - class name, eg. "com/mycompany/MyClass"
+ * - constructor signature, eg. "(Ljava/lang/String;)V"
+ * - zero or more arguments
+ *
+ * Arguments are converted like in call() and constructors are cached
+ * like static methods.
+ *
+ * Returns:
+ * - handle of created object, or string if it is a String
+ */
+static int
+new_object(lua_State *L)
+{
+  attach_thread(L);
+  arena_reset();
+  const char *class_name = luaL_checkstring(L, 1);
+  const char *constructor_signature = luaL_checkstring(L, 2);
+
+  struct method *m = resolve_method(L, METHOD_CONSTRUCTOR, class_name, NULL, NULL, "<init>", constructor_signature);
+  int nret = invoke(L, m, NULL, 3);
+  unpin_method(m);
+  return nret;
+}
+
+/**
+ * Create Java callback calling Lua function, eg.
+ * list:call("replaceAll", "(Ljava/util/function/UnaryOperator;)V",
+ * lujavrite.callback(function(x) return x * 2 end)).
+ *
+ * The callback is instance of io.kojan.lujavrite.Callback, which
+ * implements UnaryOperator and has call(Object...) method.  It can be
+ * called by Java code run by call() or other functions calling Java
+ * from the same Lua state, on the same thread, and can call Java
+ * itself.  Arguments are passed to the function converted like return
+ * values of Java methods, and its first return value is converted to
+ * Boolean, Long, Double, String, List or Map, or passed as the object
+ * it refers to if it is an object handle.  Lua errors are thrown as
+ * io.kojan.lujavrite.LuaException.
+ *
+ * Parameters:
+ * - Lua function
+ *
+ * Returns:
+ * - handle of Callback object; the function is released when it is
+ *   garbage collected
+ */
+static int
+callback(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  attach_thread(L);
+  arena_reset();
+  init_callbacks(L);
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, "lujavrite.callbacks");
+  pthread_mutex_lock(&callbacks_lock);
+  lua_Integer id = ++next_callback_id;
+  pthread_mutex_unlock(&callbacks_lock);
+
+  if ((*J)->PushLocalFrame(J, 1) != 0) {
+    raise_exception(L);
+  }
+  jvalue arg;
+  arg.j = (jlong)id;
+  jvalue obj;
+  obj.l = (*J)->NewObjectA(J, callback_class, callback_init, &arg);
+  if (obj.l == NULL) {
+    return pop_frame_and_raise(L, NULL);
+  }
+  push_result_in_frame(L, 'L', obj);
+  (*J)->PopLocalFrame(J, NULL);
+
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -3, id);
+  ((struct object *)lua_touserdata(L, -1))->callback = id;
+  return 1;
+}
+
+/**
+ * Make calls of call_batch(), taking method handle and batch as
+ * arguments.  Runs in local frame pushed by call_batch(), through
+ * run_in_frame(), so failures are raised directly.
+ */
+static int
+run_batch(lua_State *L)
+{
+  struct method *h = lua_touserdata(L, 1);
+  struct signature *sig = &h->sig;
+  lua_Integer count = (lua_Integer)lua_rawlen(L, 2);
+  jvalue *args = arena_alloc(L, sig->nargs * sizeof(jvalue));
+  struct method_stats *stats = __atomic_load_n(&stats_enabled, __ATOMIC_RELAXED) ? method_stats(L, h) : NULL;
+  struct timespec t[4];
+
+  lua_createtable(L, count < INT_MAX ? (int)count : 0, 1);
+  int results = lua_gettop(L);
+  int base = results + 1;
+  for (lua_Integer k = 1; k <= count; k++) {
+    struct arena_mark mark = arena_mark();
+    push_tuple(L, 2, k);
+    struct memo_probe probe;
+    int nret = memo_lookup(L, h, base, &probe);
+    if (nret < 0) {
+      if (stats != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &t[0]);
+      }
+      check_args(L, sig, base, lua_gettop(L) - base + 1, args);
+      if (convert_args(L, h, base, args) != 0) {
+        return raise_exception(L);
+      }
+      if (stats != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &t[1]);
+      }
+      jvalue ret = call_from_lua(L, h, NULL, args);
+      if ((*J)->ExceptionCheck(J)) {
+        return raise_exception(L);
+      }
+      if (stats != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &t[2]);
+      }
+      nret = push_result(L, sig->ret, ret);
+      if (nret < 0) {
+        return (*J)->ExceptionCheck(J) ? raise_exception(L) : luaL_error(L, "unsupported return value");
+      }
+      /* The frame is shared by the whole batch, so references created
+         by each call are deleted as soon as it is done. */
+      for (int i = 0; i < sig->nargs; i++) {
+        if (is_reference(sig->args[i]) && args[i].l != NULL) {
+          (*J)->DeleteLocalRef(J, args[i].l);
+        }
+      }
+      if (is_reference(sig->ret) && ret.l != NULL) {
+        (*J)->DeleteLocalRef(J, ret.l);
+      }
+      if (stats != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &t[3]);
+        size_t bytes_out = nret > 0 && lua_type(L, -1) == LUA_TSTRING ? lua_rawlen(L, -1) : 0;
+        record_stats(stats, t, args_bytes(L, sig, base), bytes_out);
+      }
+      memo_update(L, h, &probe, nret);
+    }
+    if (nret != 0) {
+      lua_rawseti(L, results, k);
+    }
+    lua_settop(L, results);
+    arena_release(mark);
+  }
+  lua_pushinteger(L, count);
+  lua_setfield(L, results, "n");
+  return 1;
+}
+
+/**
+ * Call prepared method once for each argument tuple.
+ *
+ * All calls are made in a single C entry, sharing one local frame and
+ * one arena reset, converting arguments and results, caching and
+ * recording statistics the same way as calls of the handle do.
+ *
+ * Each tuple is a table holding arguments of one call, or a single
+ * non-table value passed as the only argument.  A table is always
+ * unpacked, so a single table argument, eg. a List, must be wrapped in
+ * a tuple of its own: {{"a", "b"}} rather than {"a", "b"}.
+ *
+ * Parameters:
+ * - method handle, as returned by method()
+ * - array of argument tuples
+ *
+ * Returns:
+ * - table of return values, one for each tuple, with number of tuples
+ *   in field "n", as results returning nil or void leave holes
+ */
+static int
+call_batch(lua_State *L)
+{
+  struct method *h = luaL_checkudata(L, 1, "lujavrite.method");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  attach_thread(L);
+  arena_reset();
+
+  if ((*J)->PushLocalFrame(J, h->sig.nargs + 1) != 0) {
+    raise_exception(L);
+  }
+  run_in_frame(L, run_batch, 2);
+  (*J)->PopLocalFrame(J, NULL);
+  return 1;
+}
+
+#define ASYNC_WORKERS 8
+
+/**
+ * Asynchronous call, shared between the future userdata and the worker
+ * thread executing it, and freed when both are done with it.
+ *
+ * Object arguments and the result are held as global references.
+ * Strings passed as ByteBuffer are copied into buffers owned by the
+ * job, as the Lua strings may be collected before the call completes.
+ */
+struct job {
+  struct job *next;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int refs;
+  int done;
+  int fd;
+  struct method method;
+  jvalue ret;
+  jthrowable exception;
+  const char *error;
+  void *buffers[MAX_ARGS];
+  jvalue args[MAX_ARGS];
+};
+
+static pthread_mutex_t job_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct job *job_queue_head;
+static struct job *job_queue_tail;
+static int async_workers;
+/* Number of jobs being run, to let shutdown() wait for them. */
+static int async_busy;
+/* Set when worker threads fail to attach to JVM. */
+static int async_failed;
+/* Jobs failed by workers without JNIEnv to free them, see fail_jobs(). */
+static struct job *orphan_jobs;
+static pthread_cond_t job_idle_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+free_job(struct job *job)
+{
+  struct signature *sig = &job->method.sig;
+  for (int i = 0; i < sig->nargs; i++) {
+    if (is_reference(sig->args[i]) && job->args[i].l != NULL) {
+      (*J)->DeleteGlobalRef(J, job->args[i].l);
+    }
+    free(job->buffers[i]);
+  }
+  if (is_reference(sig->ret) && job->ret.l != NULL) {
+    (*J)->DeleteGlobalRef(J, job->ret.l);
+  }
+  if (job->exception != NULL) {
+    (*J)->DeleteGlobalRef(J, job->exception);
+  }
+  release_method(&job->method);
+  if (job->fd >= 0) {
+    close(job->fd);
+  }
+  pthread_cond_destroy(&job->cond);
+  pthread_mutex_destroy(&job->lock);
+  free(job);
+}
+
+static void
+release_job(struct job *job)
+{
+  pthread_mutex_lock(&job->lock);
+  int refs = --job->refs;
+  pthread_mutex_unlock(&job->lock);
+  if (refs == 0) {
+    free_job(job);
+  }
+}
+
+/**
+ * Complete all queued jobs with error, as there is no worker left to
+ * run them.  Must be called with the queue locked.  The caller may have
+ * no JNIEnv, so jobs whose futures are gone are left for submit_job()
+ * to free.
+ */
+static void
+fail_jobs(const char *error)
+{
+  while (job_queue_head != NULL) {
+    struct job *job = job_queue_head;
+    job_queue_head = job->next;
+    pthread_mutex_lock(&job->lock);
+    job->error = error;
+    job->done = 1;
+    if (job->fd >= 0) {
+      eventfd_write(job->fd, 1);
+    }
+    pthread_cond_broadcast(&job->cond);
+    int refs = --job->refs;
+    pthread_mutex_unlock(&job->lock);
+    if (refs == 0) {
+      job->next = orphan_jobs;
+      orphan_jobs = job;
+    }
+  }
+  job_queue_tail = NULL;
+  pthread_cond_broadcast(&job_idle_cond);
+}
+
+static void
+run_job(struct job *job)
+{
+  jvalue ret;
+  ret.l = NULL;
+  if ((*J)->PushLocalFrame(J, 1) == 0) {
+    ret = call_method(&job->method, NULL, job->args);
+    if (!(*J)->ExceptionCheck(J) && is_reference(job->method.sig.ret) && ret.l != NULL) {
+      ret.l = (*J)->NewGlobalRef(J, ret.l);
+    }
+    (*J)->PopLocalFrame(J, NULL);
+  }
+  jthrowable exception = (*J)->ExceptionOccurred(J);
+  if (exception != NULL) {
+    /* Exceptions are raised as Lua errors when the result is retrieved. */
+    (*J)->ExceptionClear(J);
+    job->exception = (*J)->NewGlobalRef(J, exception);
+    (*J)->DeleteLocalRef(J, exception);
+    ret.l = NULL;
+  }
+
+  pthread_mutex_lock(&job->lock);
+  job->ret = ret;
+  job->done = 1;
+  if (job->fd >= 0) {
+    eventfd_write(job->fd, 1);
+  }
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static void *
+async_worker(void *arg)
+{
+  (void)arg;
+  if (get_env() != 0) {
+    /* Queued jobs would never complete if this was the last worker. */
+    pthread_mutex_lock(&job_queue_lock);
+    if (--async_workers == 0) {
+      async_failed = 1;
+      fail_jobs("failed to attach worker thread to JVM");
+    }
+    pthread_mutex_unlock(&job_queue_lock);
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&job_queue_lock);
+    while (job_queue_head == NULL) {
+      pthread_cond_wait(&job_queue_cond, &job_queue_lock);
+    }
+    struct job *job = job_queue_head;
+    job_queue_head = job->next;
+    if (job_queue_head == NULL) {
+      job_queue_tail = NULL;
+    }
+    async_busy++;
+    pthread_mutex_unlock(&job_queue_lock);
+
+    run_job(job);
+    release_job(job);
+    pthread_mutex_lock(&job_queue_lock);
+    if (--async_busy == 0 && job_queue_head == NULL) {
+      pthread_cond_broadcast(&job_idle_cond);
+    }
+    pthread_mutex_unlock(&job_queue_lock);
+  }
+  return NULL;
+}
+
+/**
+ * Wait until all queued asynchronous calls have completed.
+ */
+static void
+wait_async_idle(void)
+{
+  pthread_mutex_lock(&job_queue_lock);
+  while (job_queue_head != NULL || async_busy != 0) {
+    pthread_cond_wait(&job_idle_cond, &job_queue_lock);
+  }
+  pthread_mutex_unlock(&job_queue_lock);
+}
+
+/**
+ * Queue job for execution by worker pool, starting the pool on first use.
+ */
+static void
+submit_job(lua_State *L, struct job *job)
+{
+  pthread_mutex_lock(&job_queue_lock);
+  struct job *orphans = orphan_jobs;
+  orphan_jobs = NULL;
+  while (orphans != NULL) {
+    struct job *next = orphans->next;
+    free_job(orphans);
+    orphans = next;
+  }
+  if (async_failed && async_workers == 0) {
+    pthread_mutex_unlock(&job_queue_lock);
+    luaL_error(L, "no worker thread could attach to JVM");
+  }
+  while (!async_failed && async_workers < ASYNC_WORKERS) {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, async_worker, NULL);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+      if (async_workers != 0) {
+        break;
+      }
+      pthread_mutex_unlock(&job_queue_lock);
+      luaL_error(L, "failed to create worker thread: %s", strerror(err));
+    }
+    async_workers++;
+  }
+  job->refs++;
+  job->next = NULL;
+  if (job_queue_tail != NULL) {
+    job_queue_tail->next = job;
+  }
+  else {
+    job_queue_head = job;
+  }
+  job_queue_tail = job;
+  pthread_cond_signal(&job_queue_cond);
+  pthread_mutex_unlock(&job_queue_lock);
+}
+
+/**
+ * Create job for call of method m with arguments taken from Lua stack,
+ * starting at index base, and push future userdata owning it.
+ */
+static struct job *
+new_job(lua_State *L, struct method *m, int base)
+{
+  struct signature *sig = &m->sig;
+  jvalue *args = arena_alloc(L, sig->nargs * sizeof(jvalue));
+  check_args(L, sig, base, lua_gettop(L) - base + 1, args);
+  lua_settop(L, base + sig->nargs - 1);
+
+  struct job **future = lua_newuserdatauv(L, sizeof(*future), 0);
+  *future = NULL;
+  luaL_setmetatable(L, "lujavrite.future");
+  struct job *job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    luaL_error(L, "out of memory");
+  }
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  job->refs = 1;
+  job->fd = -1;
+  copy_method(&job->method, m);
+  memcpy(job->args, args, sig->nargs * sizeof(jvalue));
+  *future = job;
+
+  if ((*J)->PushLocalFrame(J, 2) != 0) {
+    raise_exception(L);
+  }
+  for (int i = 0; i < sig->nargs; i++) {
+    int idx = base + i;
+    if (!is_reference(sig->args[i]) || lua_isnil(L, idx)) {
+      continue;
+    }
+    jobject obj;
+    if (sig->args[i] == 'N' && lua_type(L, idx) == LUA_TSTRING) {
+      size_t len;
+      const char *str = lua_tolstring(L, idx, &len);
+      job->buffers[i] = malloc(len ? len : 1);
+      if (job->buffers[i] == NULL) {
+        pop_frame_and_raise(L, "out of memory");
+      }
+      memcpy(job->buffers[i], str, len);
+      obj = new_read_only_buffer(job->buffers[i], len);
+    }
+    else {
+      obj = to_java_object(L, m, i, idx);
+    }
+    if ((*J)->ExceptionCheck(J)) {
+      pop_frame_and_raise(L, NULL);
+    }
+    job->args[i].l = (*J)->NewGlobalRef(J, obj);
+    (*J)->DeleteLocalRef(J, obj);
+  }
+  (*J)->PopLocalFrame(J, NULL);
+  return job;
+}
+
+/**
+ * Call static Java function asynchronously.
+ *
+ * The call is queued to a pool of native worker threads attached to
+ * JVM, letting Lua code overlap many slow calls.  Arguments are
+ * converted right away, in the same way as for call(); the return value
+ * is converted when retrieved from the future.
+ *
+ * Parameters:
+ * - either method handle, as returned by method(), or class name,
+ *   method name and method signature, like for call()
+ * - zero or more arguments
+ *
+ * Returns:
+ * - future, with the following methods:
+ *   - ready() returns true if the call has completed
+ *   - wait([timeout]) waits until the call completes, for at most
+ *     timeout seconds if given, and returns true if it has completed
+ *   - result() waits until the call completes and returns its value
+ *   - fd() returns eventfd file descriptor that becomes readable when
+ *     the call completes, for use with poll() in event loops
+ */
+static int
+call_async(lua_State *L)
+{
+  attach_thread(L);
+  arena_reset();
+  struct method *h = luaL_testudata(L, 1, "lujavrite.method");
+  if (h != NULL) {
+    submit_job(L, new_job(L, h, 2));
+    return 1;
+  }
+
+  const char *class_name = luaL_checkstring(L, 1);
+  const char *method_name = luaL_checkstring(L, 2);
+  const char *method_signature = luaL_checkstring(L, 3);
+  struct method *m = resolve_method(L, METHOD_STATIC, class_name, NULL, NULL, method_name, method_signature);
+  struct job *job = new_job(L, m, 4);
+  unpin_method(m);
+  submit_job(L, job);
+  return 1;
+}
+
+static struct job *
+check_future(lua_State *L)
+{
+  struct job **future = luaL_checkudata(L, 1, "lujavrite.future");
+  luaL_argcheck(L, *future != NULL, 1, "invalid future");
+  return *future;
+}
+
+/**
+ * Wait until job completes, or until deadline passes if given.
+ * Returns non-zero if the job has completed.
+ */
+static int
+wait_job(struct job *job, const struct timespec *deadline)
+{
+  pthread_mutex_lock(&job->lock);
+  while (!job->done) {
+    if (deadline == NULL) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    else if (pthread_cond_timedwait(&job->cond, &job->lock, deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+  return done;
+}
+
+/**
+ * Push result of completed job onto Lua stack.
+ */
+static int
+push_job_result(lua_State *L, struct job *job)
+{
+  if (job->error != NULL) {
+    return luaL_error(L, "%s", job->error);
+  }
+  if (job->exception != NULL) {
+    push_exception(L, job->exception);
+    return lua_error(L);
+  }
+  if ((*J)->PushLocalFrame(J, 1) != 0) {
+    raise_exception(L);
+  }
+  int nret = push_result_in_frame(L, job->method.sig.ret, job->ret);
+  (*J)->PopLocalFrame(J, NULL);
+  return nret;
+}
+
+static int
+future_ready(lua_State *L)
+{
+  struct job *job = check_future(L);
+  pthread_mutex_lock(&job->lock);
+  lua_pushboolean(L, job->done);
+  pthread_mutex_unlock(&job->lock);
+  return 1;
+}
+
+static int
+future_wait(lua_State *L)
+{
+  struct job *job = check_future(L);
+  if (lua_isnoneornil(L, 2)) {
+    lua_pushboolean(L, wait_job(job, NULL));
+    return 1;
+  }
+  lua_Number timeout = luaL_checknumber(L, 2);
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  if (timeout > 0) {
+    long long nsec = deadline.tv_nsec + (long long)(timeout * 1e9);
+    deadline.tv_sec += nsec / 1000000000;
+    deadline.tv_nsec = nsec % 1000000000;
+  }
+  lua_pushboolean(L, wait_job(job, &deadline));
+  return 1;
+}
+
+static int
+future_result(lua_State *L)
+{
+  struct job *job = check_future(L);
+  attach_thread(L);
+  wait_job(job, NULL);
+  return push_job_result(L, job);
+}
+
+static int
+future_fd(lua_State *L)
+{
+  struct job *job = check_future(L);
+  pthread_mutex_lock(&job->lock);
+  if (job->fd < 0) {
+    job->fd = eventfd(job->done ? 1 : 0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+  int fd = job->fd;
+  pthread_mutex_unlock(&job->lock);
+  if (fd < 0) {
+    return luaL_error(L, "eventfd() error: %s", strerror(errno));
+  }
+  lua_pushinteger(L, fd);
+  return 1;
+}
+
+static int
+future_gc(lua_State *L)
+{
+  struct job **future = luaL_checkudata(L, 1, "lujavrite.future");
+  if (*future != NULL && attach_for_gc()) {
+    release_job(*future);
+    *future = NULL;
+  }
+  return 0;
+}
+
+static int
+call_yield_k(lua_State *L, int status, lua_KContext ctx)
+{
+  (void)status;
+  struct job **future = lua_touserdata(L, (int)ctx);
+  attach_thread(L);
+  wait_job(*future, NULL);
+  return push_job_result(L, *future);
+}
 
 /**
- * Initialize Java Virtual Machine.
+ * Call static Java function, yielding current coroutine until the call
+ * completes.
  *
- * dlopen() libjvm.so and call JNI_CreateJavaVM() with specified arguments.
+ * Inside a coroutine, the call is executed asynchronously like with
+ * call_async() and the coroutine yields the future.  A scheduler can
+ * use the future to find out when the call completes and then resume
+ * the coroutine, which makes call_yield() return the call result.  If
+ * the coroutine is resumed earlier, call_yield() waits for the call to
+ * complete.  Outside of coroutines it behaves the same as call().
  *
  * Parameters:
- * - path to libjvm.so, eg. /usr/lib/jvm/java-17-openjdk/lib/server/libjvm.so
- * - zero or more arguments passed to JVM - eg. -Djava.class.path=...
+ * - either method handle, as returned by method(), or class name,
+ *   method name and method signature, like for call()
+ * - zero or more arguments
  *
  * Returns:
- * - nothing
+ * - return value of Java function, if any
  */
 static int
-init(lua_State *L)
+call_yield(lua_State *L)
 {
-  if (J != NULL) {
-    fprintf(stderr, "lujavrite: error: JVM has already been initialized\n");
-    exit(66);
+  if (!lua_isyieldable(L)) {
+    if (luaL_testudata(L, 1, "lujavrite.method") != NULL) {
+      return method_call(L);
+    }
+    return call(L);
   }
-  const char *libjvm_path = luaL_checkstring(L, 1);
-  void *libjvm = dlopen(libjvm_path, RTLD_LAZY);
-  if (!libjvm) {
-    fprintf(stderr, "lujavrite: dlopen(libjvm.so) error: %s\n", dlerror());
-    exit(66);
+  call_async(L);
+  int future = lua_gettop(L);
+  lua_pushvalue(L, future);
+  return lua_yieldk(L, 1, future, call_yield_k);
+}
+
+/**
+ * Push Java string returned by a call made for exception introspection,
+ * pushing nil if the call failed or returned null.
+ */
+static void
+push_exception_string(lua_State *L, jstring str)
+{
+  if ((*J)->ExceptionCheck(J)) {
+    (*J)->ExceptionClear(J);
+    lua_pushnil(L);
   }
-  jint (JNICALL *JNI_CreateJavaVM)(JavaVM **pvm, void **penv, void *args)
-    = dlsym(libjvm, "JNI_CreateJavaVM");
-  if (!JNI_CreateJavaVM) {
-    fprintf(stderr, "lujavrite: dlsym(JNI_CreateJavaVM) error: %s\n", dlerror());
-    exit(66);
+  else if (str == NULL || push_string(L, str) != 0) {
+    (*J)->ExceptionClear(J);
+    lua_pushnil(L);
   }
+}
 
-  int n = lua_gettop(L) - 1;
-  JavaVMOption jvmopt[n];
-  for (int i = 0; i < n; i++) {
-    jvmopt[i].optionString = (char *)luaL_checkstring(L, i + 2);
+/**
+ * Format stack trace of Java exception using printStackTrace().
+ */
+static void
+push_stack_trace(lua_State *L, jthrowable exc)
+{
+  if ((*J)->PushLocalFrame(J, 4) != 0) {
+    (*J)->ExceptionClear(J);
+    lua_pushnil(L);
+    return;
+  }
+  jstring str = NULL;
+  jobject sw = (*J)->NewObjectA(J, string_writer_class, string_writer_init, NULL);
+  if (sw != NULL) {
+    jvalue arg;
+    arg.l = sw;
+    jobject pw = (*J)->NewObjectA(J, print_writer_class, print_writer_init, &arg);
+    if (pw != NULL) {
+      arg.l = pw;
+      (*J)->CallVoidMethodA(J, exc, throwable_print_stack_trace, &arg);
+      if (!(*J)->ExceptionCheck(J)) {
+        str = (*J)->CallObjectMethodA(J, sw, object_to_string, NULL);
+      }
+    }
+  }
+  if ((*J)->ExceptionCheck(J)) {
+    (*J)->ExceptionClear(J);
+    str = NULL;
+  }
+  str = (*J)->PopLocalFrame(J, str);
+  push_exception_string(L, str);
+  if (str != NULL) {
+    (*J)->DeleteLocalRef(J, str);
+  }
+}
+
+static int
+exception_index(lua_State *L)
+{
+  jthrowable *e = luaL_checkudata(L, 1, "lujavrite.exception");
+  const char *key = luaL_checkstring(L, 2);
+  attach_thread(L);
+
+  jstring str;
+  if (strcmp(key, "class") == 0) {
+    jclass cls = (*J)->GetObjectClass(J, *e);
+    str = (*J)->CallObjectMethodA(J, cls, class_get_name, NULL);
+    (*J)->DeleteLocalRef(J, cls);
+  }
+  else if (strcmp(key, "message") == 0) {
+    str = (*J)->CallObjectMethodA(J, *e, throwable_get_message, NULL);
+  }
+  else if (strcmp(key, "traceback") == 0) {
+    if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+      lua_pop(L, 1);
+      push_stack_trace(L, *e);
+      lua_pushvalue(L, -1);
+      lua_setiuservalue(L, 1, 1);
+    }
+    return 1;
+  }
+  else {
+    lua_pushnil(L);
+    return 1;
   }
 
-  JavaVMInitArgs vmArgs;
-  vmArgs.version = JNI_VERSION_1_8;
-  vmArgs.nOptions = n;
-  vmArgs.options = jvmopt;
-  vmArgs.ignoreUnrecognized = JNI_FALSE;
+  push_exception_string(L, str);
+  if (str != NULL) {
+    (*J)->DeleteLocalRef(J, str);
+  }
+  return 1;
+}
 
-  JavaVM *javaVM;
-  jint flag = JNI_CreateJavaVM(&javaVM, (void **)&J, &vmArgs);
-  if (flag == JNI_ERR) {
-    fprintf(stderr, "lujavrite: error: failed to create JVM\n");
-    exit(66);
+static int
+exception_tostring(lua_State *L)
+{
+  jthrowable *e = luaL_checkudata(L, 1, "lujavrite.exception");
+  attach_thread(L);
+  jstring str = (*J)->CallObjectMethodA(J, *e, object_to_string, NULL);
+  push_exception_string(L, str);
+  if (str != NULL) {
+    (*J)->DeleteLocalRef(J, str);
+  }
+  if (lua_isnil(L, -1)) {
+    lua_pushliteral(L, "Java exception");
   }
+  return 1;
+}
 
+static int
+exception_gc(lua_State *L)
+{
+  jthrowable *e = luaL_checkudata(L, 1, "lujavrite.exception");
+  if (*e != NULL && attach_for_gc()) {
+    (*J)->DeleteGlobalRef(J, *e);
+    *e = NULL;
+  }
   return 0;
 }
 
+/**
+ * Release all entries of method resolution cache.
+ */
+static void
+clear_method_cache(void)
+{
+  pthread_mutex_lock(&method_cache_lock);
+  for (size_t i = 0; i < method_cache_size; i++) {
+    struct cache_entry *e = method_cache[i];
+    while (e != NULL) {
+      struct cache_entry *next = e->next;
+      release_entry(e);
+      e = next;
+    }
+    method_cache[i] = NULL;
+  }
+  method_cache_count = 0;
+  pthread_mutex_unlock(&method_cache_lock);
+}
 
 /**
- * Call static Java function that accepts zero or more String argument
- * and returns String.
+ * Flush method resolution cache.
+ *
+ * Drops all cached classes and method IDs, so that subsequent calls
+ * resolve them again, for example after class loader has been swapped.
+ * Calls in progress, including calls running a callback which flushes
+ * the cache, keep using methods they have resolved, which are
+ * released when they complete.  Method handles and pending
+ * asynchronous calls are not affected.
  *
  * Parameters:
- * - class name, eg. "com/mycompany/MyClass"
- * - method name, eg. "myMethod"
- * - method signature, eg. "(Ljava/lang/String;)Ljava/lang/String;"
- * - zero or more string arguments
+ * - none
  *
  * Returns:
- * - string return value of Java function
+ * - nothing
  */
 static int
-call(lua_State *L)
+flush_cache(lua_State *L)
+{
+  attach_thread(L);
+  clear_method_cache();
+  return 0;
+}
+
+/**
+ * Enable, resize or disable cache of Java strings passed as arguments.
+ *
+ * Strings of up to 40 bytes passed as String or Object are then reused
+ * from a cache of given capacity, evicting the least recently used
+ * ones, instead of creating new Java strings on every call.  Java code
+ * may observe that equal arguments are the same object.  Changing
+ * capacity empties the cache.  The cache is disabled by default.
+ *
+ * Parameters:
+ * - maximum number of cached strings, or 0 to disable the cache
+ *
+ * Returns:
+ * - nothing
+ */
+static int
+string_cache(lua_State *L)
 {
-  if (J == NULL) {
-    fprintf(stderr, "lujavrite: error: JVM has not been initialized\n");
-    exit(66);
+  lua_Integer capacity = luaL_checkinteger(L, 1);
+  luaL_argcheck(L, capacity >= 0 && capacity <= 1 << 20, 1, "capacity out of range");
+  attach_thread(L);
+  size_t size = 1;
+  while (size < (size_t)capacity) {
+    size <<= 1;
   }
-  const char *class_name = luaL_checkstring(L, 1);
-  const char *method_name = luaL_checkstring(L, 2);
-  const char *method_signature = luaL_checkstring(L, 3);
+  struct string_entry **buckets = capacity > 0 ? calloc(size, sizeof(*buckets)) : NULL;
+  if (capacity > 0 && buckets == NULL) {
+    return luaL_error(L, "out of memory");
+  }
+  pthread_mutex_lock(&string_cache_lock);
+  while (string_lru_head != NULL) {
+    remove_string_entry(string_lru_head);
+  }
+  free(string_cache_buckets);
+  string_cache_buckets = buckets;
+  string_cache_size = size;
+  string_cache_capacity = (size_t)capacity;
+  pthread_mutex_unlock(&string_cache_lock);
+  return 0;
+}
 
-  jclass jcls = (*J)->FindClass(J, class_name);
-  if (jcls == NULL) {
-    (*J)->ExceptionDescribe(J);
-    exit(66);
+static jobject memory_bean;
+static jobject gc_beans;
+static jmethodID memory_get_heap_usage;
+static jmethodID memory_get_non_heap_usage;
+static jmethodID usage_get_used;
+static jmethodID usage_get_committed;
+static jmethodID usage_get_max;
+static jmethodID list_size;
+static jmethodID list_get;
+static jmethodID gc_get_name;
+static jmethodID gc_get_collection_count;
+static jmethodID gc_get_collection_time;
+static int memory_ready;
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Resolve memory and garbage collector management beans on first use,
+ * raising Lua error if they are not available.
+ */
+static void
+init_memory(lua_State *L)
+{
+  static const struct {
+    const char *class_name;
+    const char *name;
+    const char *signature;
+    jmethodID *id;
+  } methods[] = {
+    {"java/lang/management/MemoryMXBean", "getHeapMemoryUsage", "()Ljava/lang/management/MemoryUsage;",
+     &memory_get_heap_usage},
+    {"java/lang/management/MemoryMXBean", "getNonHeapMemoryUsage", "()Ljava/lang/management/MemoryUsage;",
+     &memory_get_non_heap_usage},
+    {"java/lang/management/MemoryUsage", "getUsed", "()J", &usage_get_used},
+    {"java/lang/management/MemoryUsage", "getCommitted", "()J", &usage_get_committed},
+    {"java/lang/management/MemoryUsage", "getMax", "()J", &usage_get_max},
+    {"java/util/List", "size", "()I", &list_size},
+    {"java/util/List", "get", "(I)Ljava/lang/Object;", &list_get},
+    {"java/lang/management/MemoryManagerMXBean", "getName", "()Ljava/lang/String;", &gc_get_name},
+    {"java/lang/management/GarbageCollectorMXBean", "getCollectionCount", "()J", &gc_get_collection_count},
+    {"java/lang/management/GarbageCollectorMXBean", "getCollectionTime", "()J", &gc_get_collection_time},
+  };
+  pthread_mutex_lock(&memory_lock);
+  int ok = memory_ready;
+  if (!ok) {
+    ok = 1;
+    for (size_t i = 0; ok && i < sizeof(methods) / sizeof(methods[0]); i++) {
+      jclass cls = (*J)->FindClass(J, methods[i].class_name);
+      ok = cls != NULL
+        && (*methods[i].id = (*J)->GetMethodID(J, cls, methods[i].name, methods[i].signature)) != NULL;
+      (*J)->DeleteLocalRef(J, cls);
+    }
+    jclass factory = ok ? (*J)->FindClass(J, "java/lang/management/ManagementFactory") : NULL;
+    jmethodID get_memory = factory != NULL
+      ? (*J)->GetStaticMethodID(J, factory, "getMemoryMXBean", "()Ljava/lang/management/MemoryMXBean;")
+      : NULL;
+    jmethodID get_gcs = get_memory != NULL
+      ? (*J)->GetStaticMethodID(J, factory, "getGarbageCollectorMXBeans", "()Ljava/util/List;")
+      : NULL;
+    jobject bean = get_gcs != NULL ? (*J)->CallStaticObjectMethodA(J, factory, get_memory, NULL) : NULL;
+    jobject gcs = bean != NULL ? (*J)->CallStaticObjectMethodA(J, factory, get_gcs, NULL) : NULL;
+    ok = gcs != NULL;
+    if (ok) {
+      memory_bean = (*J)->NewGlobalRef(J, bean);
+      gc_beans = (*J)->NewGlobalRef(J, gcs);
+      memory_ready = 1;
+    }
+    (*J)->DeleteLocalRef(J, gcs);
+    (*J)->DeleteLocalRef(J, bean);
+    (*J)->DeleteLocalRef(J, factory);
   }
-  jmethodID methodId = (*J)->GetStaticMethodID(J, jcls, method_name, method_signature);
-  if (methodId == NULL) {
-    (*J)->ExceptionDescribe(J);
-    exit(66);
+  pthread_mutex_unlock(&memory_lock);
+  if (!ok) {
+    raise_exception(L);
   }
+}
 
-  int n = lua_gettop(L) - 3;
-  jvalue args[n];
-  for (int i = 0; i < n; i++) {
-    if (lua_isnil(L, i + 4)) {
-      args[i].l = NULL;
+/**
+ * Build table returned by memory(), running in local frame pushed by
+ * memory(), through run_in_frame().
+ */
+static int
+collect_memory(lua_State *L)
+{
+  static const struct {
+    jmethodID *getter;
+    const char *used;
+    const char *committed;
+    const char *max;
+  } areas[] = {
+    {&memory_get_heap_usage, "heap_used", "heap_committed", "heap_max"},
+    {&memory_get_non_heap_usage, "non_heap_used", "non_heap_committed", "non_heap_max"},
+  };
+  lua_createtable(L, 0, 9);
+  for (size_t i = 0; i < sizeof(areas) / sizeof(areas[0]); i++) {
+    jobject usage = (*J)->CallObjectMethodA(J, memory_bean, *areas[i].getter, NULL);
+    if (usage == NULL) {
+      return raise_exception(L);
     }
-    else {
-      args[i].l = (*J)->NewStringUTF(J, luaL_checkstring(L, i + 4));
+    jlong used = (*J)->CallLongMethodA(J, usage, usage_get_used, NULL);
+    jlong committed = (*J)->CallLongMethodA(J, usage, usage_get_committed, NULL);
+    jlong max = (*J)->CallLongMethodA(J, usage, usage_get_max, NULL);
+    if ((*J)->ExceptionCheck(J)) {
+      return raise_exception(L);
+    }
+    (*J)->DeleteLocalRef(J, usage);
+    set_count_field(L, areas[i].used, (uint64_t)used);
+    set_count_field(L, areas[i].committed, (uint64_t)committed);
+    if (max >= 0) {
+      set_count_field(L, areas[i].max, (uint64_t)max);
     }
   }
 
-  jstring ret = (*J)->CallStaticObjectMethodA(J, jcls, methodId, args);
+  jint n = (*J)->CallIntMethodA(J, gc_beans, list_size, NULL);
   if ((*J)->ExceptionCheck(J)) {
-    (*J)->ExceptionDescribe(J);
-    exit(66);
+    return raise_exception(L);
+  }
+  uint64_t total_count = 0;
+  jlong total_time = 0;
+  lua_createtable(L, 0, n);
+  for (jint i = 0; i < n; i++) {
+    jvalue arg;
+    arg.i = i;
+    jobject bean = (*J)->CallObjectMethodA(J, gc_beans, list_get, &arg);
+    jstring name = bean != NULL ? (*J)->CallObjectMethodA(J, bean, gc_get_name, NULL) : NULL;
+    if (name == NULL) {
+      return raise_exception(L);
+    }
+    jlong count = (*J)->CallLongMethodA(J, bean, gc_get_collection_count, NULL);
+    jlong millis = (*J)->CallLongMethodA(J, bean, gc_get_collection_time, NULL);
+    if ((*J)->ExceptionCheck(J) || push_string(L, name) != 0) {
+      return raise_exception(L);
+    }
+    (*J)->DeleteLocalRef(J, name);
+    (*J)->DeleteLocalRef(J, bean);
+    lua_createtable(L, 0, 2);
+    /* Collectors report -1 for values they don't track. */
+    if (count >= 0) {
+      set_count_field(L, "count", (uint64_t)count);
+      total_count += (uint64_t)count;
+    }
+    if (millis >= 0) {
+      lua_pushnumber(L, millis / 1e3);
+      lua_setfield(L, -2, "time");
+      total_time += millis;
+    }
+    lua_settable(L, -3);
   }
+  lua_setfield(L, -2, "gc");
+  set_count_field(L, "gc_count", total_count);
+  lua_pushnumber(L, total_time / 1e3);
+  lua_setfield(L, -2, "gc_time");
+  return 1;
+}
 
-  if ((*J)->IsSameObject(J, ret, NULL)) {
-    lua_pushnil(L);
+/**
+ * Report JVM memory usage and garbage collection activity, as seen by
+ * java.lang.management beans, eg. to tune -Xmx and GC options.
+ *
+ * Parameters:
+ * - none
+ *
+ * Returns:
+ * - table with heap_used, heap_committed, heap_max, non_heap_used,
+ *   non_heap_committed and non_heap_max fields in bytes (max fields are
+ *   nil when there is no limit), gc_count and gc_time fields with total
+ *   number of collections and seconds spent in them, and gc field
+ *   mapping each collector name to table with its count and time
+ */
+static int
+memory(lua_State *L)
+{
+  attach_thread(L);
+  arena_reset();
+  init_memory(L);
+  if ((*J)->PushLocalFrame(J, 2) != 0) {
+    raise_exception(L);
   }
-  else {
-    const char *ret1 = (*J)->GetStringUTFChars(J, ret, NULL);
-    lua_pushstring(L, ret1);
-    (*J)->ReleaseStringUTFChars(J, ret, ret1);
+  run_in_frame(L, collect_memory, 0);
+  (*J)->PopLocalFrame(J, NULL);
+  return 1;
+}
+
+/**
+ * Shut down Java Virtual Machine.
+ *
+ * Waits for pending asynchronous calls and for non-daemon Java threads
+ * to complete, releases cached classes and strings, destroys the JVM
+ * with DestroyJavaVM() and unloads libjvm.so.  When connected to JVM
+ * server, the connection is closed instead.  A JVM can't be created
+ * again in the same process, so any later call to Java raises an
+ * error, and objects still referenced from Lua are dropped without
+ * being released.  Must not be called while other threads are calling
+ * Java functions.  Calling it again, or before init(), does nothing.
+ *
+ * Parameters:
+ * - none
+ *
+ * Returns:
+ * - time taken, in seconds
+ */
+static int
+shutdown_jvm(lua_State *L)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (server_mode) {
+    if (server_fd >= 0) {
+      close(server_fd);
+      server_fd = -1;
+    }
+    server_mode = 0;
+    pthread_mutex_lock(&jvm_lock);
+    jvm_state = JVM_SHUT_DOWN;
+    pthread_mutex_unlock(&jvm_lock);
+    lua_pushnumber(L, elapsed_since(&start));
+    return 1;
+  }
+
+  pthread_mutex_lock(&jvm_lock);
+  while (jvm_state == JVM_STARTING) {
+    pthread_cond_wait(&jvm_cond, &jvm_lock);
+  }
+  int state = jvm_state;
+  if (state != JVM_READY && state != JVM_NONE) {
+    /* Deferred or failed JVM doesn't need to be destroyed. */
+    if (state == JVM_DEFERRED) {
+      free_deferred();
+    }
+    jvm_state = JVM_SHUT_DOWN;
+  }
+  pthread_mutex_unlock(&jvm_lock);
+  if (state != JVM_READY) {
+    lua_pushnumber(L, elapsed_since(&start));
+    return 1;
+  }
+
+  attach_thread(L);
+  wait_async_idle();
+  release_pins();
+  clear_method_cache();
+  pthread_mutex_lock(&string_cache_lock);
+  while (string_lru_head != NULL) {
+    remove_string_entry(string_lru_head);
+  }
+  free(string_cache_buckets);
+  string_cache_buckets = NULL;
+  string_cache_size = 0;
+  string_cache_capacity = 0;
+  pthread_mutex_unlock(&string_cache_lock);
+
+  pthread_mutex_lock(&jvm_lock);
+  jvm_state = JVM_SHUT_DOWN;
+  __atomic_store_n(&jvm_shut_down, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&jvm_lock);
+  jint ret = (*jvm)->DestroyJavaVM(jvm);
+  J = NULL;
+  jvm = NULL;
+  if (ret == JNI_OK && libjvm_handle != NULL) {
+    dlclose(libjvm_handle);
+  }
+  libjvm_handle = NULL;
+  if (ret != JNI_OK) {
+    return luaL_error(L, "failed to destroy JVM: error %d", (int)ret);
+  }
+  lua_pushnumber(L, elapsed_since(&start));
+  return 1;
+}
+
+/**
+ * Enable or disable collection of call statistics.
+ *
+ * Statistics are recorded for calls made through call() and method
+ * handles.  While disabled, collection costs a single flag check per
+ * call.
+ *
+ * Parameters:
+ * - true to enable, false to disable
+ *
+ * Returns:
+ * - nothing
+ */
+static int
+enable_stats(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TBOOLEAN);
+  __atomic_store_n(&stats_enabled, lua_toboolean(L, 1), __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void
+set_time_field(lua_State *L, const char *name, uint64_t ns)
+{
+  lua_pushnumber(L, (double)ns / 1e9);
+  lua_setfield(L, -2, name);
+}
+
+/**
+ * Get upper bound of latency below which given fraction of calls fall.
+ */
+static uint64_t
+stats_percentile(const struct method_stats *s, double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * (double)s->count + 0.5);
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += s->histogram[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t limit = stats_bucket_limit(i);
+      return limit < s->max_ns ? limit : s->max_ns;
+    }
+  }
+  return s->max_ns;
+}
+
+/**
+ * Push table describing statistics of single method.
+ */
+static void
+push_method_stats(lua_State *L, const struct method_stats *s, const char *key)
+{
+  const char *method_name = key + strlen(key) + 1;
+  const char *method_signature = method_name + strlen(method_name) + 1;
+  lua_createtable(L, 0, 20);
+  lua_pushstring(L, key);
+  lua_setfield(L, -2, "class");
+  lua_pushstring(L, method_name);
+  lua_setfield(L, -2, "method");
+  lua_pushstring(L, method_signature);
+  lua_setfield(L, -2, "signature");
+  set_count_field(L, "count", s->count);
+  set_time_field(L, "total", s->total_ns);
+  set_time_field(L, "min", s->min_ns);
+  set_time_field(L, "max", s->max_ns);
+  set_time_field(L, "marshal", s->marshal_ns);
+  set_time_field(L, "call", s->call_ns);
+  set_time_field(L, "result", s->result_ns);
+  set_time_field(L, "p50", stats_percentile(s, 0.50));
+  set_time_field(L, "p90", stats_percentile(s, 0.90));
+  set_time_field(L, "p99", stats_percentile(s, 0.99));
+  set_time_field(L, "p999", stats_percentile(s, 0.999));
+  set_count_field(L, "bytes_in", s->bytes_in);
+  set_count_field(L, "bytes_out", s->bytes_out);
+
+  lua_newtable(L);
+  lua_Integer n = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    if (s->histogram[i] != 0) {
+      lua_createtable(L, 2, 0);
+      lua_pushnumber(L, (double)stats_bucket_limit(i) / 1e9);
+      lua_rawseti(L, -2, 1);
+      lua_pushinteger(L, (lua_Integer)s->histogram[i]);
+      lua_rawseti(L, -2, 2);
+      lua_rawseti(L, -2, ++n);
+    }
+  }
+  lua_setfield(L, -2, "histogram");
+}
+
+/**
+ * Get call statistics collected since last reset_stats().
+ *
+ * Returns:
+ * - table with one entry per called method, keyed by
+ *   "class.method signature", each holding class, method and signature
+ *   names, call count, total, min, max, p50, p90, p99 and p999
+ *   latencies, total time spent converting arguments (marshal), in the
+ *   JNI call itself (call) and converting results (result), string and
+ *   byte payload sizes sent to Java (bytes_in) and returned from it
+ *   (bytes_out), and latency histogram as list of
+ *   {upper bound, count} pairs.  Times are in seconds.
+ */
+static int
+stats(lua_State *L)
+{
+  /* Counters are copied under the lock and converted afterwards, as
+     Lua functions may raise errors.  Keys are immutable. */
+  pthread_mutex_lock(&stats_lock);
+  size_t n = stats_count;
+  pthread_mutex_unlock(&stats_lock);
+  struct {
+    struct method_stats s;
+    const char *key;
+  } *snapshot = lua_newuserdatauv(L, n * sizeof(*snapshot) + 1, 0);
+
+  size_t k = 0;
+  pthread_mutex_lock(&stats_lock);
+  for (size_t i = 0; i < STATS_TABLE_SIZE; i++) {
+    for (struct method_stats *s = stats_table[i]; s != NULL && k < n; s = s->next) {
+      if (s->count != 0) {
+        snapshot[k].s = *s;
+        snapshot[k].key = s->key;
+        k++;
+      }
+    }
   }
+  pthread_mutex_unlock(&stats_lock);
 
+  lua_createtable(L, 0, (int)k);
+  for (size_t i = 0; i < k; i++) {
+    const char *method_name = snapshot[i].key + strlen(snapshot[i].key) + 1;
+    lua_pushfstring(L, "%s.%s%s", snapshot[i].key, method_name, method_name + strlen(method_name) + 1);
+    push_method_stats(L, &snapshot[i].s, snapshot[i].key);
+    lua_rawset(L, -3);
+  }
   return 1;
 }
 
+/**
+ * Discard collected call statistics.
+ *
+ * Returns:
+ * - nothing
+ */
+static int
+reset_stats(lua_State *L)
+{
+  (void)L;
+  pthread_mutex_lock(&stats_lock);
+  for (size_t i = 0; i < STATS_TABLE_SIZE; i++) {
+    for (struct method_stats *s = stats_table[i]; s != NULL; s = s->next) {
+      clear_stats(s);
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+  return 0;
+}
+
 /**
  * Register lua module.
  * Called by Lua when loading library.
@@ -153,10 +6353,136 @@ luaopen_lujavrite(lua_State *L)
 {
   static const struct luaL_Reg functs[] = {
     {"init", init},
+    {"init_fast", init_fast},
+    {"init_lazy", init_lazy},
+    {"find_jvm", find_jvm},
+    {"shutdown", shutdown_jvm},
     {"call", call},
+    {"method", method},
+    {"new", new_object},
+    {"loader", new_loader},
+    {"callback", callback},
+    {"stream", stream},
+    {"channel", channel},
+    {"call_batch", call_batch},
+    {"call_async", call_async},
+    {"call_yield", call_yield},
+    {"flush_cache", flush_cache},
+    {"string_cache", string_cache},
+    {"memory", memory},
+    {"enable_stats", enable_stats},
+    {"stats", stats},
+    {"reset_stats", reset_stats},
+    {NULL, NULL},
+  };
+  static const struct luaL_Reg method_meta[] = {
+    {"__call", method_call},
+    {"__gc", method_gc},
+    {NULL, NULL},
+  };
+
+  static const struct luaL_Reg method_methods[] = {
+    {"memoize", method_memoize},
+    {"invalidate", method_invalidate},
+    {"memo_stats", method_memo_stats},
+    {NULL, NULL},
+  };
+
+  static const struct luaL_Reg object_meta[] = {
+    {"__gc", object_gc},
+    {"__tostring", object_tostring},
+    {"__eq", object_eq},
+    {NULL, NULL},
+  };
+
+  static const struct luaL_Reg object_methods[] = {
+    {"call", object_call},
+    {"totable", object_totable},
+    {NULL, NULL},
+  };
+
+  static const struct luaL_Reg future_methods[] = {
+    {"ready", future_ready},
+    {"wait", future_wait},
+    {"result", future_result},
+    {"fd", future_fd},
+    {NULL, NULL},
+  };
+
+  static const struct luaL_Reg channel_methods[] = {
+    {"push", channel_push},
+    {"pop", channel_pop},
+    {"close", channel_close},
+    {"java", channel_java},
+    {NULL, NULL},
+  };
+
+  static const struct luaL_Reg loader_methods[] = {
+    {"call", loader_call},
+    {"new", loader_new},
+    {"method", loader_method},
     {NULL, NULL},
   };
 
+  static const struct luaL_Reg exception_meta[] = {
+    {"__index", exception_index},
+    {"__tostring", exception_tostring},
+    {"__gc", exception_gc},
+    {NULL, NULL},
+  };
+
+  luaL_newmetatable(L, "lujavrite.method");
+  luaL_setfuncs(L, method_meta, 0);
+  lua_newtable(L);
+  luaL_setfuncs(L, method_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.object");
+  luaL_setfuncs(L, object_meta, 0);
+  lua_newtable(L);
+  luaL_setfuncs(L, object_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.exception");
+  luaL_setfuncs(L, exception_meta, 0);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.remote_exception");
+  lua_pushcfunction(L, remote_exception_tostring);
+  lua_setfield(L, -2, "__tostring");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.stream");
+  lua_pushcfunction(L, stream_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.channel");
+  lua_pushcfunction(L, channel_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, channel_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.loader");
+  lua_pushcfunction(L, loader_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, loader_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "lujavrite.future");
+  lua_pushcfunction(L, future_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  luaL_setfuncs(L, future_methods, 0);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
   lua_newtable(L);
   luaL_setfuncs(L, functs, 0);
   return 1;
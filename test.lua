@@ -23,7 +23,12 @@ if java_home == nil then
 end
 
 -- Initialize JVM
-lujavrite.init(java_home .. "/lib/server/libjvm.so", "-ea", "-esa")
+local startup_time = lujavrite.init(java_home .. "/lib/server/libjvm.so", "-ea", "-esa", "-Djava.class.path=lujavrite.jar")
+assert(type(startup_time) == "number")
+print(string.format("JVM created in %.3f s", startup_time))
+assert(not pcall(lujavrite.init_lazy, java_home .. "/lib/server/libjvm.so", true))
+local found_jvm = lujavrite.find_jvm()
+assert(found_jvm == nil or found_jvm:find("/lib/server/libjvm.so", 1, true))
 
 -- System.getProperty(key)
 function get_property(key)
@@ -51,3 +56,400 @@ print("foo is " .. get_property("foo"))
 
 local java_nil = lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", nil)
 print("nil in Lua is " .. java_nil .. " in Java")
+
+-- Repeated calls are served from method resolution cache
+for i = 1, 1000 do
+   assert(get_property("foo") == "bar")
+end
+lujavrite.flush_cache()
+assert(get_property("foo") == "bar")
+print("method cache works")
+
+-- Prepared method handles
+local getprop = lujavrite.method(
+   "java/lang/System", "getProperty",
+   "(Ljava/lang/String;)Ljava/lang/String;"
+)
+assert(getprop("java.version") == java_version)
+assert(getprop("foo") == "bar")
+print("method handles work")
+
+-- Local references don't leak across calls
+for i = 1, 100000 do
+   set_property("foo", "bar")
+end
+print("local references are released")
+
+-- Typed arguments and return values
+assert(lujavrite.call("java/lang/Math", "max", "(II)I", 3, 7) == 7)
+assert(lujavrite.call("java/lang/Math", "abs", "(J)J", -1234567890123) == 1234567890123)
+assert(lujavrite.call("java/lang/Math", "sqrt", "(D)D", 2.25) == 1.5)
+assert(lujavrite.call("java/lang/Boolean", "parseBoolean", "(Ljava/lang/String;)Z", "true") == true)
+assert(lujavrite.call("java/lang/Integer", "toHexString", "(I)Ljava/lang/String;", 255) == "ff")
+assert(lujavrite.call("java/lang/String", "valueOf", "(Z)Ljava/lang/String;", false) == "false")
+assert(select("#", lujavrite.call("java/lang/System", "gc", "()V")) == 0)
+print("typed marshalling works")
+
+-- Lua strings passed as byte[]
+assert(lujavrite.call("java/util/Arrays", "toString", "([B)Ljava/lang/String;", "hi\0!") == "[104, 105, 0, 33]")
+print("byte arrays work")
+
+-- Binary-safe return values
+assert(lujavrite.call("java/lang/String", "valueOf", "(C)Ljava/lang/String;", 0) == "\0")
+assert(lujavrite.call("java/lang/Character", "toString", "(I)Ljava/lang/String;", 0x1F600) == "\u{1F600}")
+assert(lujavrite.call("java/util/Arrays", "copyOf", "([BI)[B", "a\0bc", 3) == "a\0b")
+print("binary-safe returns work")
+
+-- Batch calls
+local results = lujavrite.call_batch(getprop, {"java.version", "foo", {"no.such.property"}})
+assert(results[1] == java_version and results[2] == "bar" and results[3] == nil and results.n == 3)
+local max = lujavrite.method("java/lang/Math", "max", "(II)I")
+results = lujavrite.call_batch(max, {{1, 2}, {4, 3}})
+assert(#results == 2 and results[1] == 2 and results[2] == 4)
+local path_of = lujavrite.method("java/nio/file/Path", "of", "(Ljava/lang/String;[Ljava/lang/String;)Ljava/nio/file/Path;")
+results = lujavrite.call_batch(path_of, {{"a", {"b", "c"}}})
+assert(tostring(results[1]) == "a/b/c")
+assert(not pcall(lujavrite.call_batch, max, {{1, 2, 3}}))
+assert(lujavrite.call_batch(max, {{5, 6}})[1] == 6)
+local coll_max = lujavrite.method("java/util/Collections", "max", "(Ljava/util/Collection;)Ljava/lang/Object;")
+results = lujavrite.call_batch(coll_max, {{{"a", "c", "b"}}, {{"x"}}})
+assert(results.n == 2 and results[1] == "c" and results[2] == "x")
+print("batch calls work")
+
+-- Asynchronous calls
+local futures = {}
+for i = 1, 20 do
+   futures[i] = lujavrite.call_async("java/lang/Math", "max", "(II)I", i, 10)
+end
+futures[21] = lujavrite.call_async(getprop, "foo")
+assert(futures[1]:wait(10) == true and futures[1]:ready() == true)
+assert(type(futures[2]:fd()) == "number")
+for i = 1, 20 do
+   assert(futures[i]:result() == math.max(i, 10))
+end
+assert(futures[21]:result() == "bar")
+print("asynchronous calls work")
+
+-- Yielding calls from coroutines
+local co = coroutine.wrap(function()
+   return lujavrite.call_yield("java/lang/Math", "max", "(II)I", 5, 6)
+end)
+local future = co()
+assert(future:wait(10))
+assert(co() == 6)
+assert(lujavrite.call_yield(getprop, "foo") == "bar")
+print("yielding calls work")
+
+-- Java exceptions are raised as Lua errors
+local ok, err = pcall(lujavrite.call, "java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", "x")
+assert(not ok)
+assert(err.class == "java.lang.NumberFormatException")
+assert(err.message == 'For input string: "x"')
+assert(err.traceback:find("at java.lang.Integer.parseInt", 1, true))
+assert(tostring(err):find("NumberFormatException", 1, true))
+ok, err = pcall(lujavrite.call, "no/such/Class", "foo", "()V")
+assert(not ok and err.class == "java.lang.NoClassDefFoundError")
+ok, err = pcall(lujavrite.call, "java/lang/Math", "max", "(II)I", "x", 1)
+assert(not ok and type(err) == "string")
+assert(not pcall(lujavrite.call, "java/util/Arrays", "toString", "([Q)Ljava/lang/String;", {}))
+ok, err = pcall(futures[1].result, lujavrite.call_async("java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", "y"))
+assert(not ok and err.class == "java.lang.NumberFormatException")
+assert(lujavrite.call("java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", "42") == 42)
+print("errors are recoverable")
+
+-- Call statistics
+lujavrite.reset_stats()
+lujavrite.enable_stats(true)
+for i = 1, 100 do
+   lujavrite.call("java/lang/Math", "max", "(II)I", i, 50)
+   getprop("foo")
+end
+lujavrite.enable_stats(false)
+lujavrite.call("java/lang/Math", "max", "(II)I", 1, 2)
+local st = lujavrite.stats()
+local max_stats = st["java/lang/Math.max(II)I"]
+assert(max_stats.count == 100)
+assert(max_stats.method == "max" and max_stats.signature == "(II)I")
+assert(max_stats.min <= max_stats.p50 and max_stats.p99 <= max_stats.max)
+assert(max_stats.marshal + max_stats.call + max_stats.result <= max_stats.total + 1e-6)
+local prop_stats = st["java/lang/System.getProperty(Ljava/lang/String;)Ljava/lang/String;"]
+assert(prop_stats.count == 100 and prop_stats.bytes_in == 300 and prop_stats.bytes_out == 300)
+local n = 0
+for _, bucket in ipairs(prop_stats.histogram) do
+   n = n + bucket[2]
+end
+assert(n == 100)
+lujavrite.reset_stats()
+assert(next(lujavrite.stats()) == nil)
+print("call statistics work")
+
+-- Temporary buffers are reused, also after errors
+local big = ("abc"):rep(100000)
+for i = 1, 10 do
+   assert(not pcall(lujavrite.call, "java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", big))
+   assert(lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", big) == big)
+end
+print("call buffers are reused")
+
+-- Strings are passed as standard UTF-8, including NUL and supplementary characters
+local text = "a\0b \u{E9}\u{20AC}\u{1F600} " .. ("x"):rep(100)
+assert(lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", text) == text)
+assert(lujavrite.call("java/lang/Character", "codePointAt", "(Ljava/lang/CharSequence;I)I", "\u{1F600}", 0) == 0x1F600)
+assert(lujavrite.call("java/lang/Character", "codePointAt", "(Ljava/lang/CharSequence;I)I", "a\0b", 1) == 0)
+assert(lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", "\xFF") == "\u{FFFD}")
+print("strings are transcoded correctly")
+
+-- Java objects are returned as handles, which can be passed back to Java
+local list = lujavrite.call("java/util/Collections", "singletonList", "(Ljava/lang/Object;)Ljava/util/List;", "x")
+assert(type(list) == "userdata")
+assert(tostring(list) == "[x]")
+local ro = lujavrite.call("java/util/Collections", "unmodifiableList", "(Ljava/util/List;)Ljava/util/List;", list)
+assert(lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", ro) == "[x]")
+local empty = lujavrite.call("java/util/Collections", "emptyList", "()Ljava/util/List;")
+assert(empty == lujavrite.call("java/util/Collections", "emptyList", "()Ljava/util/List;"))
+assert(empty ~= list)
+ok, err = pcall(lujavrite.call, "java/util/Collections", "unmodifiableMap", "(Ljava/util/Map;)Ljava/util/Map;", list)
+assert(not ok and err.class == "java.lang.IllegalArgumentException")
+ok, err = pcall(lujavrite.call, "java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", list)
+assert(not ok and err.class == "java.lang.IllegalArgumentException")
+list, ro, empty = nil, nil, nil
+collectgarbage()
+print("object handles work")
+
+-- Constructors and instance methods
+local sb = lujavrite.new("java/lang/StringBuilder", "(Ljava/lang/String;)V", "foo")
+assert(sb:call("append", "(I)Ljava/lang/StringBuilder;", 42) == sb)
+assert(sb:call("length", "()I") == 5)
+assert(sb:call("toString", "()Ljava/lang/String;") == "foo42")
+local array_list = lujavrite.new("java/util/ArrayList", "()V")
+for i = 1, 3 do
+   assert(array_list:call("add", "(Ljava/lang/Object;)Z", "x" .. i) == true)
+end
+assert(array_list:call("size", "()I") == 3)
+assert(array_list:call("get", "(I)Ljava/lang/Object;", 1) == "x2")
+-- Same method resolved in different classes
+local single = lujavrite.call("java/util/Collections", "singletonList", "(Ljava/lang/Object;)Ljava/util/List;", "x")
+assert(single:call("size", "()I") == 1)
+assert(lujavrite.new("java/lang/String", "(Ljava/lang/String;)V", "bar") == "bar")
+ok, err = pcall(sb.call, sb, "noSuchMethod", "()V")
+assert(not ok and err.class == "java.lang.NoSuchMethodError")
+print("instance calls work")
+
+-- Lua tables converted to List, Map and String[] and back
+assert(lujavrite.call("java/lang/String", "join", "(Ljava/lang/CharSequence;Ljava/lang/Iterable;)Ljava/lang/String;", ",", lujavrite.call("java/util/List", "copyOf", "(Ljava/util/Collection;)Ljava/util/List;", {"a", "b", "c"})) == "a,b,c")
+assert(tostring(lujavrite.call("java/nio/file/Path", "of", "(Ljava/lang/String;[Ljava/lang/String;)Ljava/nio/file/Path;", "a", {"b", "c"})) == "a/b/c")
+local pattern = lujavrite.call("java/util/regex/Pattern", "compile", "(Ljava/lang/String;)Ljava/util/regex/Pattern;", ",")
+local parts = pattern:call("split", "(Ljava/lang/CharSequence;)[Ljava/lang/String;", "x,y,\u{1F600}")
+assert(#parts == 3 and parts[1] == "x" and parts[3] == "\u{1F600}")
+local map = lujavrite.call("java/util/Map", "copyOf", "(Ljava/util/Map;)Ljava/util/Map;", {a = 1, b = {true, 2.5}, c = {d = "e"}})
+assert(map:call("size", "()I") == 3)
+local t = map:totable()
+assert(t.a == 1 and t.b[1] == true and t.b[2] == 2.5 and t.c.d == "e")
+local big_list = {}
+for i = 1, 10000 do
+   big_list[i] = i
+end
+assert(#lujavrite.call("java/util/List", "copyOf", "(Ljava/util/Collection;)Ljava/util/List;", big_list):totable() == 10000)
+assert(not pcall(lujavrite.call, "java/util/List", "copyOf", "(Ljava/util/Collection;)Ljava/util/List;", {x = 1}))
+pattern, map, t, big_list = nil, nil, nil, nil
+print("table conversion works")
+
+-- Lua callbacks called from Java
+local seen = 0
+local double = lujavrite.callback(function(x)
+   seen = seen + 1
+   return x * 2
+end)
+local numbers = lujavrite.new("java/util/ArrayList", "(Ljava/util/Collection;)V", {1, 2, 3})
+numbers:call("replaceAll", "(Ljava/util/function/UnaryOperator;)V", double)
+assert(seen == 3)
+t = numbers:totable()
+assert(t[1] == 2 and t[2] == 4 and t[3] == 6)
+local cache = lujavrite.new("java/util/HashMap", "()V")
+local exclaim = lujavrite.callback(function(key)
+   return lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", key) .. "!"
+end)
+assert(cache:call("computeIfAbsent", "(Ljava/lang/Object;Ljava/util/function/Function;)Ljava/lang/Object;", "k", exclaim) == "k!")
+local failing = lujavrite.callback(function() error("boom") end)
+ok, err = pcall(failing.call, failing, "apply", "(Ljava/lang/Object;)Ljava/lang/Object;", nil)
+assert(not ok and err.class == "io.kojan.lujavrite.LuaException" and err.message:find("boom", 1, true))
+local parse = lujavrite.callback(function(s)
+   return lujavrite.call("java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", s)
+end)
+ok, err = pcall(parse.call, parse, "apply", "(Ljava/lang/Object;)Ljava/lang/Object;", "x")
+assert(not ok and err.class == "java.lang.NumberFormatException")
+assert(tostring(parse:call("apply", "(Ljava/lang/Object;)Ljava/lang/Object;", "12")) == "12")
+-- Flushing the cache while the call using it is in progress is safe
+local flushing = lujavrite.callback(function(x)
+   lujavrite.flush_cache()
+   return lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", x)
+end)
+local flushed = lujavrite.new("java/util/ArrayList", "(Ljava/util/Collection;)V", {"a", "b"})
+flushed:call("replaceAll", "(Ljava/util/function/UnaryOperator;)V", flushing)
+assert(table.concat(flushed:totable()) == "ab")
+flushing, flushed = nil, nil
+-- Other Java threads have no Lua state to run the callback in
+local async = lujavrite.call("java/util/concurrent/CompletableFuture", "completedFuture",
+                             "(Ljava/lang/Object;)Ljava/util/concurrent/CompletableFuture;", "x")
+   :call("thenApplyAsync", "(Ljava/util/function/Function;)Ljava/util/concurrent/CompletableFuture;", exclaim)
+ok, err = pcall(async.call, async, "join", "()Ljava/lang/Object;")
+assert(not ok and err.class == "java.util.concurrent.CompletionException")
+assert(err.message:find("java.lang.IllegalStateException", 1, true))
+async = nil
+double, numbers, cache, exclaim, failing, parse, t = nil, nil, nil, nil, nil, nil, nil
+print("Lua callbacks work")
+
+-- Primitive arrays converted from and to Lua sequences
+assert(lujavrite.call("java/util/Arrays", "toString", "([I)Ljava/lang/String;", {3, -1, 2147483647}) == "[3, -1, 2147483647]")
+assert(lujavrite.call("java/util/Arrays", "stream", "([D)Ljava/util/stream/DoubleStream;", {0.5, 1.5, 2}):call("sum", "()D") == 4)
+local sorted = lujavrite.call("java/util/Arrays", "copyOf", "([JI)[J", {5, 1 << 40, -7}, 4)
+assert(#sorted == 4 and sorted[2] == 1 << 40 and sorted[4] == 0)
+local floats = lujavrite.call("java/util/Arrays", "copyOf", "([FI)[F", {0.25}, 1)
+assert(floats[1] == 0.25)
+assert(#lujavrite.call("java/util/Arrays", "copyOf", "([SI)[S", {}, 0) == 0)
+assert(not pcall(lujavrite.call, "java/util/Arrays", "toString", "([I)Ljava/lang/String;", {1, 2.5}))
+assert(not pcall(lujavrite.call, "java/util/Arrays", "toString", "([S)Ljava/lang/String;", {40000}))
+assert(not pcall(lujavrite.call, "java/util/Arrays", "toString", "([F)Ljava/lang/String;", {1e39}))
+assert(lujavrite.call("java/util/Arrays", "toString", "([F)Ljava/lang/String;", {1 / 0, -0.5}) == "[Infinity, -0.5]")
+sorted, floats = nil, nil
+print("primitive arrays work")
+
+-- Interned argument strings
+lujavrite.string_cache(4)
+for i = 1, 100 do
+   assert(get_property("foo") == "bar")
+   assert(lujavrite.call("java/lang/String", "valueOf", "(Ljava/lang/Object;)Ljava/lang/String;", "k" .. i % 8) == "k" .. i % 8)
+end
+local same = lujavrite.call("java/util/Objects", "equals", "(Ljava/lang/Object;Ljava/lang/Object;)Z", "a\0\u{E9}", "a\0\u{E9}")
+assert(same == true)
+lujavrite.string_cache(0)
+assert(get_property("foo") == "bar")
+print("string cache works")
+
+-- Memoized method handles
+local memo_getprop = lujavrite.method("java/lang/System", "getProperty", "(Ljava/lang/String;)Ljava/lang/String;")
+assert(memo_getprop.memo_stats(memo_getprop) == nil)
+assert(memo_getprop:memoize(2) == memo_getprop)
+for i = 1, 10 do
+   assert(memo_getprop("foo") == "bar")
+   assert(memo_getprop("no.such.property") == nil)
+end
+local ms = memo_getprop:memo_stats()
+assert(ms.hits == 18 and ms.misses == 2 and ms.size == 2 and ms.capacity == 2)
+set_property("foo", "baz")
+assert(memo_getprop("foo") == "bar")
+memo_getprop:invalidate()
+assert(memo_getprop("foo") == "baz")
+set_property("foo", "bar")
+memo_getprop("java.version")
+memo_getprop("foo")
+assert(memo_getprop:memo_stats().size == 2)
+local memo_split = lujavrite.method("java/util/Arrays", "copyOf", "([II)[I"):memoize(4)
+assert(memo_split({1, 2}, 2)[2] == 2 and memo_split:memo_stats().misses == 0)
+lujavrite.enable_stats(true)
+local hits = memo_getprop:memo_stats().hits
+results = lujavrite.call_batch(memo_getprop, {"foo", "foo", {"no.such.property"}})
+lujavrite.enable_stats(false)
+assert(results[1] == "bar" and results[2] == "bar" and results[3] == nil)
+assert(memo_getprop:memo_stats().hits == hits + 2)
+assert(lujavrite.stats()["java/lang/System.getProperty(Ljava/lang/String;)Ljava/lang/String;"].count == 1)
+lujavrite.reset_stats()
+memo_getprop, memo_split = nil, nil
+print("memoized handles work")
+
+-- Streaming results in chunks
+local range = lujavrite.call("java/util/stream/IntStream", "range", "(II)Ljava/util/stream/IntStream;", 0, 1000)
+local chunks, total, last = 0, 0, nil
+for chunk in lujavrite.stream(range, 300) do
+   chunks = chunks + 1
+   assert(#chunk <= 300)
+   for _, v in ipairs(chunk) do
+      total = total + v
+      last = v
+   end
+end
+assert(chunks == 4 and total == 499500 and last == 999)
+local words = lujavrite.call("java/util/List", "copyOf", "(Ljava/util/Collection;)Ljava/util/List;", {"a", "b", "c"})
+local seen_words = {}
+for chunk in lujavrite.stream(words) do
+   for _, w in ipairs(chunk) do
+      seen_words[#seen_words + 1] = w
+   end
+end
+assert(table.concat(seen_words) == "abc")
+assert(not pcall(lujavrite.stream, sb))
+range, words = nil, nil
+print("streaming works")
+
+-- Channels between Lua and Java
+local ch = lujavrite.channel(100)
+local jch = ch:java()
+assert(ch:pop(0) == nil)
+assert(ch:push("hello") and ch:push(""))
+assert(jch:call("poll", "()[B") == "hello")
+assert(jch:call("poll", "()[B") == "")
+assert(jch:call("poll", "()[B") == nil)
+assert(jch:call("offer", "([B)Z", "from java"))
+assert(ch:pop() == "from java")
+local pushed = 0
+while ch:push(string.rep("x", 10), 0) do
+   pushed = pushed + 1
+end
+assert(pushed == 128 // 16)
+for i = 1, pushed do
+   assert(#jch:call("poll", "()[B") == 10)
+   assert(ch:push(tostring(i), 0))
+end
+assert(not pcall(ch.push, ch, string.rep("x", 200)))
+ch:close()
+assert(jch:call("isClosed", "()Z"))
+assert(not pcall(ch.push, ch, "late"))
+for i = 1, pushed do
+   assert(jch:call("take", "()[B") == tostring(i))
+end
+assert(jch:call("take", "()[B") == nil and ch:pop() == nil)
+ch, jch = nil, nil
+print("channels work")
+
+-- Memory introspection
+local mem = lujavrite.memory()
+assert(mem.heap_used > 0 and mem.heap_committed >= mem.heap_used)
+assert(mem.heap_max == nil or mem.heap_max >= mem.heap_committed)
+assert(mem.non_heap_used > 0)
+lujavrite.call("java/lang/System", "gc", "()V")
+local after = lujavrite.memory()
+assert(after.gc_count >= mem.gc_count and after.gc_time >= 0)
+local gc_total = 0
+for name, gc in pairs(after.gc) do
+   assert(type(name) == "string")
+   gc_total = gc_total + (gc.count or 0)
+end
+assert(gc_total == after.gc_count)
+print("memory introspection works")
+
+-- Isolated class loaders
+local plugins = lujavrite.loader({"bench/classes"})
+assert(rawequal(plugins, lujavrite.loader({"bench/classes"})))
+assert(plugins:call("Bench", "echo", "(Ljava/lang/String;)Ljava/lang/String;", "plugin") == "plugin")
+assert(plugins:call("java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", "42") == 42)
+assert(not pcall(lujavrite.call, "Bench", "empty", "()V"))
+local other = lujavrite.loader({"bench/classes", "lujavrite.jar"})
+assert(not rawequal(plugins, other))
+local echo = other:method("Bench", "echo", "(Ljava/lang/String;)Ljava/lang/String;")
+assert(echo("x") == "x")
+assert(other:new("java/lang/StringBuilder", "(Ljava/lang/String;)V", "sb"):call("length", "()I") == 2)
+assert(not pcall(plugins.call, plugins, "no/such/Class", "f", "()V"))
+plugins, other, echo = nil, nil, nil
+collectgarbage()
+print("class loaders work")
+
+-- Shutdown; must stay the last test
+local future = lujavrite.call_async("java/lang/String", "valueOf", "(I)Ljava/lang/String;", 7)
+assert(type(lujavrite.shutdown()) == "number")
+assert(future:ready())
+assert(not pcall(lujavrite.call, "java/lang/String", "valueOf", "(I)Ljava/lang/String;", 1))
+assert(not pcall(lujavrite.init, nil))
+assert(type(lujavrite.shutdown()) == "number")
+future = nil
+collectgarbage()
+print("shutdown works")